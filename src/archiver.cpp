@@ -1,8 +1,15 @@
-#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <memory>
+#include <system_error>
+#include <thread>
 
 #include "console_reader.h"
 #include "decoder.h"
 #include "encoder.h"
+#include "read_ahead_source.h"
+#include "write_behind_sink.h"
 
 using Arguments = std::vector<std::string_view>;
 
@@ -12,63 +19,337 @@ public:
     }
 };
 
-int Decode(const Arguments& args) {
-    std::ifstream input(std::string(args[1]), std::ios_base::binary);
+struct Settings {
+    enum class Backend { STREAM, FD, MMAP };
 
-    if (!input.is_open()) {
-        throw FileNotFound("can't open: " + std::string(args[1]));
-    }
-
-    Decoder decoder(BitReader(input), "./");
-    decoder.Decode();
+    Backend io = Backend::STREAM;
+    size_t buffer_size = BitStream::ADAPTIVE_BUFFER_SIZE;
+    size_t read_ahead = 0;
+    size_t write_behind = 0;
+    size_t pipeline_depth = 0;
+    size_t single_read_limit = 0;
+    CodeLengths::Builder code_lengths = CodeLengths::Builder::TRIE;
+    size_t max_code_length = 0;
+    size_t sample_size = 0;
+    size_t block_size = 0;
+    // 0: one for -c, all cores for --dry-run
+    size_t threads = 0;
+    bool show_statistics = false;
+};
 
-    input.close();
-    return 0;
+std::string_view OptionValue(const Arguments& args) {
+    auto position = args[0].find('=');
+    if (position != std::string_view::npos) {
+        return args[0].substr(position + 1);
+    }
+    if (args.size() > 1) {
+        return args[1];
+    }
+    throw InvalidArgument("expected a value for " + std::string(args[0]));
 }
-int Encode(const Arguments& args) {
-    std::ofstream output(std::string(args[1]), std::ios_base::binary);
 
-    if (!output.is_open()) {
-        throw FileNotFound("can't open: " + std::string(args[1]));
+size_t ParseSize(std::string_view value) {
+    size_t answer = 0;
+    size_t i = 0;
+    while (i < value.size() && std::isdigit(value[i])) {
+        answer = answer * 10 + (value[i] - '0');
+        ++i;
     }
+    if (i == 0 || i + 1 < value.size()) {
+        throw InvalidArgument("expected a size, got: " + std::string(value));
+    }
+    if (i < value.size()) {
+        switch (std::toupper(value[i])) {
+            case 'K':
+                return answer << 10;
+            case 'M':
+                return answer << 20;
+            case 'G':
+                return answer << 30;
+            default:
+                throw InvalidArgument("expected a size, got: " + std::string(value));
+        }
+    }
+    return answer;
+}
 
-    Encoder encoder({.output = BitWriter(output)});
-    for (size_t i = 2; i < args.size(); ++i) {
-        std::string path = std::string(args[i]);
-        std::ifstream file(path, std::ios_base::binary);
-
-        if (!file.is_open()) {
-            throw FileNotFound("can't open: " + std::string(args[i]));
+std::unique_ptr<ByteSource> OpenSource(const std::string& path, const Settings& settings) {
+    std::unique_ptr<ByteSource> source;
+    try {
+        switch (settings.io) {
+            case Settings::Backend::FD:
+                source = std::make_unique<FdSource>(path);
+                break;
+            case Settings::Backend::MMAP:
+                // pipes and terminals are read as they come
+                if (std::filesystem::is_regular_file(path)) {
+                    source = std::make_unique<MmapSource>(path);
+                } else {
+                    source = std::make_unique<FdSource>(path);
+                }
+                break;
+            default:
+                source = std::make_unique<FileStreamSource>(path);
         }
+    } catch (const std::system_error& e) {
+        throw FileNotFound(e.what());
+    }
+    if (settings.read_ahead != 0) {
+        source = std::make_unique<ReadAheadSource>(std::move(source), settings.buffer_size, settings.read_ahead);
+    }
+    return source;
+}
+std::unique_ptr<ByteSink> OpenSink(const std::string& path, const Settings& settings) {
+    std::unique_ptr<ByteSink> sink;
+    try {
+        // there is no mmap sink, output size is not known in advance
+        if (settings.io == Settings::Backend::STREAM) {
+            sink = std::make_unique<FileStreamSink>(path);
+        } else {
+            sink = std::make_unique<FdSink>(path);
+        }
+    } catch (const std::system_error& e) {
+        throw FileNotFound(e.what());
+    }
+    if (settings.write_behind != 0) {
+        sink = std::make_unique<WriteBehindSink>(std::move(sink), settings.write_behind);
+    }
+    return sink;
+}
 
-        auto pos_name_start = path.rfind('/');
+// The file at `path`, named in the archive without its directories
+Encoder::InputStream OpenInput(const std::string& path, const Settings& settings) {
+    auto file = OpenSource(path, settings);
+
+    auto pos_name_start = path.rfind('/');
+    if (pos_name_start == std::string::npos) {
+        pos_name_start = path.rfind('\\');
         if (pos_name_start == std::string::npos) {
-            pos_name_start = path.rfind('\\');
-            if (pos_name_start == std::string::npos) {
-                pos_name_start = 0;
-            } else {
-                ++pos_name_start;
-            }
+            pos_name_start = 0;
         } else {
             ++pos_name_start;
         }
+    } else {
+        ++pos_name_start;
+    }
+    return {.name = path.substr(pos_name_start), .input = BitReader(std::move(file), settings.buffer_size)};
+}
+Encoder::Options EncoderOptions(const Settings& settings) {
+    return {.single_read_limit = settings.single_read_limit,
+            .code_lengths = settings.code_lengths,
+            .max_code_length = settings.max_code_length,
+            .sample_size = settings.sample_size,
+            .block_size = settings.block_size,
+            .block_threads = std::max<size_t>(settings.threads, 1),
+            .histogram_threads = std::max<size_t>(settings.threads, 1),
+            .pipeline_depth = settings.pipeline_depth};
+}
 
-        bool is_last = (i + 1) == args.size();
-        encoder.EncodeFile({.name = path.substr(pos_name_start), .input = BitReader(file)}, is_last);
+int SetBackend(const Arguments& args, Settings& settings) {
+    auto value = OptionValue(args);
+    if (value == "stream") {
+        settings.io = Settings::Backend::STREAM;
+    } else if (value == "fd") {
+        settings.io = Settings::Backend::FD;
+    } else if (value == "mmap") {
+        settings.io = Settings::Backend::MMAP;
+    } else {
+        throw InvalidArgument("unknown io backend: " + std::string(value));
+    }
+    return 0;
+}
+
+int SetCodeLengths(const Arguments& args, Settings& settings) {
+    auto value = OptionValue(args);
+    if (value == "trie") {
+        settings.code_lengths = CodeLengths::Builder::TRIE;
+    } else if (value == "in-place") {
+        settings.code_lengths = CodeLengths::Builder::IN_PLACE;
+    } else {
+        throw InvalidArgument("unknown code lengths builder: " + std::string(value));
+    }
+    return 0;
+}
+
+int Decode(const Arguments& args, const Settings& settings) {
+    Decoder decoder(BitReader(OpenSource(std::string(args[1]), settings), settings.buffer_size), "./",
+                    settings.pipeline_depth);
+    decoder.Decode();
+
+    if (settings.show_statistics) {
+        std::cerr << "archive reads: " << decoder.GetStatistics().input_reads << "\n";
+    }
+    return 0;
+}
+int Encode(const Arguments& args, const Settings& settings) {
+    if (settings.pipeline_depth != 0 && (settings.block_size == 0 || settings.threads > 1)) {
+        std::cerr << "--pipeline has no effect on -c without --block-size or with -j\n";
+    }
+    Encoder encoder({.output = BitWriter(OpenSink(std::string(args[1]), settings), settings.buffer_size)},
+                    EncoderOptions(settings));
+    auto size_of = [&](size_t index) {
+        std::error_code error;
+        auto size = std::filesystem::file_size(std::string(args[index + 2]), error);
+        return error ? 0 : static_cast<size_t>(size);
+    };
+    encoder.EncodeFiles(
+        args.size() - 2, [&](size_t index) { return OpenInput(std::string(args[index + 2]), settings); },
+        std::max<size_t>(settings.threads, 1), size_of);
+
+    if (settings.show_statistics) {
+        auto statistics = encoder.GetStatistics();
+        std::cerr << "input reads: " << statistics.input_reads << "\n";
+        std::cerr << "archive writes: " << statistics.output_writes << "\n";
+        std::cerr << "spilled bytes: " << statistics.spilled_bytes << "\n";
+        std::cerr << "stored files: " << statistics.stored_files << "\n";
+        if (settings.sample_size != 0) {
+            std::cerr << "sampled: " << statistics.sampled_stored_files << " stored on the estimate, "
+                      << statistics.sampled_scanned_files << " scanned in full";
+            if (statistics.sampled_scanned_files != 0) {
+                std::cerr << " (" << statistics.sample_misses << " stored after all, mean entropy error "
+                          << statistics.sample_entropy_error / statistics.sampled_scanned_files << " bits per byte)";
+            }
+            std::cerr << "\n";
+        }
+        if (settings.block_size != 0) {
+            std::cerr << "blocks: " << statistics.coded_blocks << " coded, " << statistics.stored_blocks << " stored\n";
+        }
+        for (size_t i = 0; i < statistics.workers.size(); ++i) {
+            const auto& worker = statistics.workers[i];
+            std::cerr << "worker " << i << ": " << worker.tasks << " tasks, " << worker.stolen << " stolen, "
+                      << 100 * worker.utilization << "% busy\n";
+        }
+        std::cerr << "coded bits: " << statistics.coded_bits << " (optimal: " << statistics.optimal_coded_bits;
+        if (statistics.optimal_coded_bits != 0) {
+            auto loss = static_cast<double>(statistics.coded_bits - statistics.optimal_coded_bits);
+            std::cerr << ", length limit loss: " << 100 * loss / statistics.optimal_coded_bits << "%";
+        }
+        std::cerr << ")\n";
+    }
+    return 0;
+}
 
-        file.close();
+int PredictSize(const Arguments& args, const Settings& settings) {
+    auto threads = settings.threads != 0 ? settings.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    auto prediction = Encoder::PredictSize(
+        args.size() - 1, [&](size_t index) { return OpenInput(std::string(args[index + 1]), settings); },
+        EncoderOptions(settings), threads);
+    for (size_t i = 0; i < prediction.entries.size(); ++i) {
+        const auto& entry = prediction.entries[i];
+        std::cout << args[i + 1] << ": " << entry.bits << " bits, " << (entry.stored ? "stored" : "coded") << "\n";
     }
-    output.close();
+    std::cout << "archive: " << prediction.archive_bytes << " bytes\n";
     return 0;
 }
 
 int main(int argc, char const** argv) {
     ConsoleReader console_reader(std::cerr);
 
-    console_reader.SetDescription("Zips and Unzips files");
+    Settings settings;
+
+    console_reader.SetDescription("Zips and Unzips files. Options apply to the commands that follow them");
     try {
-        console_reader.AddParam("-c", Encode, "-c archive_name file1 [file2 ...]: zip files into archive_name", 3);
-        console_reader.AddParam("-d", Decode, "-d archive_name: unzip archive_name into current directory", 2, 0);
+        console_reader.AddParam(
+            "-c", [&settings](const Arguments& args) { return Encode(args, settings); },
+            "-c archive_name file1 [file2 ...]: zip files into archive_name", 3);
+        console_reader.AddParam(
+            "-d", [&settings](const Arguments& args) { return Decode(args, settings); },
+            "-d archive_name: unzip archive_name into current directory", 2, 0);
+        console_reader.AddParam(
+            "--dry-run", [&settings](const Arguments& args) { return PredictSize(args, settings); },
+            "--dry-run file1 [file2 ...]: print the size of the archive -c would make, without making it", 2);
+        console_reader.AddParam(
+            "-j",
+            [&settings](const Arguments& args) {
+                settings.threads = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "-j N: encode up to N files, or blocks of a file, at once (default: 1)", 1, 1);
+        console_reader.AddParam(
+            "--io", [&settings](const Arguments& args) { return SetBackend(args, settings); },
+            "--io=stream|fd|mmap: how files are read and written (default: stream)", 1, 1);
+        console_reader.AddParam(
+            "--buffer",
+            [&settings](const Arguments& args) {
+                settings.buffer_size = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--buffer=SIZE[K|M|G]: I/O buffer size (default: picked from the file size)", 1, 1);
+        console_reader.AddParam(
+            "--read-ahead",
+            [&settings](const Arguments& args) {
+                settings.read_ahead = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--read-ahead=N: read inputs on a helper thread, up to N buffers ahead (default: 0, off)", 1, 1);
+        console_reader.AddParam(
+            "--write-behind",
+            [&settings](const Arguments& args) {
+                settings.write_behind = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--write-behind=N: write the archive on a helper thread, up to N buffers behind (default: 0, off)", 1, 1);
+        console_reader.AddParam(
+            "--pipeline",
+            [&settings](const Arguments& args) {
+                settings.pipeline_depth = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--pipeline=N: read, code and write blocks in stages on their own threads, up to N blocks queued between "
+            "stages. -c pipelines only with --block-size and without -j (default: 0, off)",
+            1, 1);
+        console_reader.AddParam(
+            "--single-read",
+            [&settings](const Arguments& args) {
+                settings.single_read_limit = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--single-read=SIZE[K|M|G]: read files up to SIZE once, keeping them in memory (default: 0, read twice)", 1,
+            1);
+        console_reader.AddParam(
+            "--code-lengths", [&settings](const Arguments& args) { return SetCodeLengths(args, settings); },
+            "--code-lengths=trie|in-place: how Huffman code lengths are built (default: trie)", 1, 1);
+        console_reader.AddParam(
+            "--max-code-length",
+            [&settings](const Arguments& args) {
+                auto value = ParseSize(OptionValue(args));
+                if (value != 0 && value < CodeLengths::MIN_LENGTH_LIMIT) {
+                    throw InvalidArgument("code lengths can't be limited below " +
+                                          std::to_string(CodeLengths::MIN_LENGTH_LIMIT));
+                }
+                settings.max_code_length = value;
+                return 0;
+            },
+            "--max-code-length=N: limit Huffman codes to N >= 9 bits (default: 0, no limit)", 1, 1);
+        console_reader.AddParam(
+            "--sample",
+            [&settings](const Arguments& args) {
+                settings.sample_size = ParseSize(OptionValue(args));
+                return 0;
+            },
+            "--sample=SIZE[K|M|G]: store files that look incompressible in a SIZE sample without reading them twice "
+            "(default: 0, off)",
+            1, 1);
+        console_reader.AddParam(
+            "--block-size",
+            [&settings](const Arguments& args) {
+                auto value = ParseSize(OptionValue(args));
+                if (value > Encoder::MAX_BLOCK_SIZE) {
+                    throw InvalidArgument("blocks can't be larger than " + std::to_string(Encoder::MAX_BLOCK_SIZE));
+                }
+                settings.block_size = value;
+                return 0;
+            },
+            "--block-size=SIZE[K|M|G]: code files larger than SIZE in blocks of it, each with its own table "
+            "(default: 0, one table per file)",
+            1, 1);
+        console_reader.AddParam(
+            "--stats",
+            [&settings](const Arguments& args) {
+                settings.show_statistics = true;
+                return 0;
+            },
+            "--stats: print I/O statistics to stderr", 1, 0);
         console_reader.AddParam(
             "-h",
             [&console_reader](const Arguments& args) {
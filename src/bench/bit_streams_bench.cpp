@@ -0,0 +1,139 @@
+// Throughput of BitReader::ReadSome and BitWriter::WriteSome for every width from 1 to 32,
+// starting byte-aligned (offset 0) and not (offset 3), over each I/O backend.
+//
+// Usage: bench_bit_streams [megabytes per run, default 4]
+// Prints one JSON object per line:
+// {"op": "read", "backend": "fd", "width": 5, "offset": 3, "bits": ..., "ns_per_bit": ..., "gb_per_s": ...}
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bit_reader.h"
+#include "bit_writer.h"
+#include "read_ahead_source.h"
+#include "write_behind_sink.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Run {
+    std::string op;
+    std::string backend;
+    size_t width;
+    size_t offset;
+    size_t bits;
+    double seconds;
+};
+
+void Print(const Run& run) {
+    auto nanoseconds = run.seconds * 1e9;
+    std::cout << "{\"op\": \"" << run.op << "\", \"backend\": \"" << run.backend << "\", \"width\": " << run.width
+              << ", \"offset\": " << run.offset << ", \"bits\": " << run.bits
+              << ", \"ns_per_bit\": " << nanoseconds / run.bits
+              << ", \"gb_per_s\": " << run.bits / BitStream::CHAR_SIZE / nanoseconds << "}\n";
+}
+
+std::vector<uint32_t> MakeValues(size_t count, size_t width) {
+    std::mt19937 generator(width);
+    std::vector<uint32_t> values(count);
+    auto mask = static_cast<uint32_t>((static_cast<uint64_t>(1) << width) - 1);
+    for (auto& value : values) {
+        value = generator() & mask;
+    }
+    return values;
+}
+
+double Write(BitWriter&& bit_writer, const std::vector<uint32_t>& values, size_t width, size_t offset) {
+    auto start = Clock::now();
+    bit_writer.WriteSome(0, offset);
+    for (auto value : values) {
+        bit_writer.WriteSome(value, width);
+    }
+    bit_writer.Flush();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double Read(BitReader&& bit_reader, const std::vector<uint32_t>& values, size_t width, size_t offset) {
+    auto start = Clock::now();
+    bit_reader.ReadSome(offset);
+    uint64_t checksum = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        checksum += bit_reader.ReadSome(width).first;
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    uint64_t expected = 0;
+    for (auto value : values) {
+        expected += value;
+    }
+    if (checksum != expected) {
+        throw std::runtime_error("read back wrong values, width = " + std::to_string(width));
+    }
+    return seconds;
+}
+
+}  // namespace
+
+int main(int argc, char const** argv) {
+    size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 4;
+    auto path = (std::filesystem::temp_directory_path() / "bench_bit_streams.bin").string();
+
+    using SinkFactory = std::function<std::unique_ptr<ByteSink>()>;
+    using SourceFactory = std::function<std::unique_ptr<ByteSource>()>;
+
+    std::vector<char> memory;
+    std::stringstream stream;
+    std::vector<std::pair<std::string, SinkFactory>> sinks = {
+        {"memory",
+         [&memory] {
+             memory.clear();
+             return std::make_unique<MemorySink>(memory);
+         }},
+        {"stream",
+         [&stream] {
+             stream.clear();
+             stream.str("");
+             return std::make_unique<StreamSink>(stream);
+         }},
+        {"fd", [&path] { return std::make_unique<FdSink>(path); }},
+        {"write_behind_fd", [&path] { return std::make_unique<WriteBehindSink>(std::make_unique<FdSink>(path)); }},
+    };
+    std::vector<std::pair<std::string, SourceFactory>> sources = {
+        {"memory", [&memory] { return std::make_unique<MemorySource>(std::span(memory.data(), memory.size())); }},
+        {"stream",
+         [&stream] {
+             stream.clear();
+             stream.seekg(0);
+             return std::make_unique<StreamSource>(stream);
+         }},
+        {"fd", [&path] { return std::make_unique<FdSource>(path); }},
+        {"mmap", [&path] { return std::make_unique<MmapSource>(path); }},
+        {"read_ahead_fd", [&path] { return std::make_unique<ReadAheadSource>(std::make_unique<FdSource>(path)); }},
+    };
+
+    for (size_t width = 1; width <= BitReader::MAX_GET_REQUEST; ++width) {
+        auto values = MakeValues(megabytes * (1 << 20) * BitStream::CHAR_SIZE / width, width);
+        auto bits = values.size() * width;
+
+        for (size_t offset : {0, 3}) {
+            // every sink leaves a copy for the sources: memory and stream ones in memory, the rest in the file
+            for (auto& [name, open] : sinks) {
+                Print({"write", name, width, offset, bits, Write(BitWriter(open()), values, width, offset)});
+            }
+            for (auto& [name, open] : sources) {
+                Print({"read", name, width, offset, bits, Read(BitReader(open()), values, width, offset)});
+            }
+        }
+    }
+
+    std::filesystem::remove(path);
+    return 0;
+}
@@ -0,0 +1,42 @@
+// Time to build code lengths from a histogram, with each CodeLengths::Builder.
+//
+// Usage: bench_code_lengths [histograms, default 2000]
+// Prints one JSON object per line:
+// {"builder": "in_place", "symbols": 259, "histograms": ..., "us_per_histogram": ...}
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "code_lengths.h"
+
+int main(int argc, char const** argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 2000;
+
+    std::vector<std::pair<std::string, CodeLengths::Builder>> builders = {
+        {"trie", CodeLengths::Builder::TRIE},
+        {"in_place", CodeLengths::Builder::IN_PLACE},
+    };
+    std::mt19937_64 generator(5);
+    for (size_t symbols : {16, 64, 259}) {
+        std::vector<CodeLengths::Frequencies> histograms(count);
+        for (auto& frequencies : histograms) {
+            for (size_t i = 0; i < symbols; ++i) {
+                frequencies[i] = 1 + generator() % 100000;
+            }
+        }
+        for (auto& [name, builder] : builders) {
+            uint64_t checksum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& frequencies : histograms) {
+                checksum += CodeLengths::Build(frequencies, builder)[0];
+            }
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "{\"builder\": \"" << name << "\", \"symbols\": " << symbols << ", \"histograms\": " << count
+                      << ", \"us_per_histogram\": " << seconds * 1e6 / count << ", \"checksum\": " << checksum << "}\n";
+        }
+    }
+    return 0;
+}
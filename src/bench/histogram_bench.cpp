@@ -0,0 +1,78 @@
+// Throughput of the Histogram kernels, against the plain counting loop, on inputs from uniform to a single byte.
+//
+// Usage: bench_histogram [megabytes per input, default 64]
+// Prints one JSON object per line:
+// {"kernel": "words", "input": "runs", "bytes": ..., "seconds": ..., "gb_per_s": ...}
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<BitStream::CharType> MakeInput(const std::string& kind, size_t size) {
+    std::mt19937 generator(7);
+    std::vector<BitStream::CharType> input(size);
+    if (kind == "uniform") {
+        for (auto& byte : input) {
+            byte = static_cast<BitStream::CharType>(generator());
+        }
+    } else if (kind == "text") {
+        // roughly the skew of English text
+        std::geometric_distribution<int> distribution(0.15);
+        for (auto& byte : input) {
+            byte = static_cast<BitStream::CharType>(' ' + std::min(distribution(generator), 90));
+        }
+    } else if (kind == "runs") {
+        std::geometric_distribution<size_t> run_length(0.01);
+        for (size_t i = 0; i < size;) {
+            auto byte = static_cast<BitStream::CharType>(generator() % 4);
+            for (auto end = std::min(size, i + 1 + run_length(generator)); i < end; ++i) {
+                input[i] = byte;
+            }
+        }
+    }
+    // "constant" stays all zeros
+    return input;
+}
+
+}  // namespace
+
+int main(int argc, char const** argv) {
+    size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 64;
+    const size_t block_size = 1 << 16;
+
+    std::vector<std::pair<std::string, Histogram::Kernel>> kernels = {
+        {"simple", Histogram::Kernel::SIMPLE},
+        {"interleaved", Histogram::Kernel::INTERLEAVED},
+        {"words", Histogram::Kernel::WORDS},
+    };
+    for (const std::string input_kind : {"uniform", "text", "runs", "constant"}) {
+        auto input = MakeInput(input_kind, megabytes << 20);
+        for (auto& [name, kernel] : kernels) {
+            auto start = Clock::now();
+            Histogram histogram(kernel);
+            for (size_t i = 0; i < input.size(); i += block_size) {
+                histogram.Add(std::span(input).subspan(i, std::min(block_size, input.size() - i)));
+            }
+            Histogram::CountType total = 0;
+            for (auto count : histogram.GetCounts()) {
+                total += count;
+            }
+            auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            if (total != input.size()) {
+                throw std::runtime_error("wrong total for " + name);
+            }
+            std::cout << "{\"kernel\": \"" << name << "\", \"input\": \"" << input_kind
+                      << "\", \"bytes\": " << input.size() << ", \"seconds\": " << seconds
+                      << ", \"gb_per_s\": " << input.size() / seconds / 1e9 << "}\n";
+        }
+    }
+    return 0;
+}
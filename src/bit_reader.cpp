@@ -1,6 +1,30 @@
 #include "bit_reader.h"
 
-BitReader::BitReader(std::istream& input) : bit_stream_(), input_(input) {
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+BitReader::Size InitialBufferSize(const ByteSource& source, BitReader::Size buffer_size) {
+    if (source.CanBorrow()) {
+        // the buffer is never used
+        return BitStream::MIN_BUFFER_SIZE;
+    }
+    if (buffer_size != BitStream::ADAPTIVE_BUFFER_SIZE) {
+        return buffer_size;
+    }
+    // Small files get one buffer of their size, large ones start big. Unknown sizes grow in FreeBuffer
+    return BitStream::AdaptiveBufferSize(source.SizeHint());
+}
+
+}  // namespace
+
+BitReader::BitReader(std::istream& input) : BitReader(std::make_unique<StreamSource>(input)) {
+}
+BitReader::BitReader(std::unique_ptr<ByteSource> source, Size buffer_size)
+    : bit_stream_(InitialBufferSize(*source, buffer_size)),
+      source_(std::move(source)),
+      adaptive_(buffer_size == BitStream::ADAPTIVE_BUFFER_SIZE) {
 }
 
 std::pair<BitReader::ResultType, bool> BitReader::ReadSome(size_t count) {
@@ -10,59 +34,190 @@ std::pair<BitReader::ResultType, bool> BitReader::ReadSome(size_t count) {
                                   ". That overflows current result type = " + typeid(ResultType).name() + "!");
     }
 
-    auto& buffer = bit_stream_.buffer;
+    // A failed read consumes nothing: bits stay in the accumulator for the next call
+    if (accumulator_size_ < count && Refill() < count) {
+        return {0, false};
+    }
+    auto answer = static_cast<ResultType>(Peek(count));
+    Consume(count);
+    return {answer, true};
+}
+BitReader::Size BitReader::ReadBytes(std::span<BitStream::CharType> target) {
     auto& buffer_pointer = bit_stream_.buffer_pointer;
-    auto& bit_pointer = bit_stream_.bit_pointer;
     auto& buffer_current_size = bit_stream_.buffer_current_size;
 
-    auto current_buffer_pointer = buffer_pointer;
-    auto current_bit_pointer = bit_pointer;
-    auto current_buffer_current_size = buffer_current_size;
-
-    ResultType answer = 0;
     Size read = 0;
+    if (accumulator_size_ % CHAR_SIZE != 0) {
+        while (read < target.size() && Refill() >= CHAR_SIZE) {
+            while (read < target.size() && accumulator_size_ >= CHAR_SIZE) {
+                target[read++] = static_cast<BitStream::CharType>(Peek(CHAR_SIZE));
+                Consume(CHAR_SIZE);
+            }
+        }
+        return read;
+    }
 
-    while (read < count) {
+    while (read < target.size() && accumulator_size_ != 0) {
+        target[read++] = static_cast<BitStream::CharType>(Peek(CHAR_SIZE));
+        Consume(CHAR_SIZE);
+    }
+    if (read == target.size()) {
+        return read;
+    }
+    // The accumulator may still hold bits of the buffer that is skipped now
+    accumulator_ = 0;
+
+    while (read < target.size()) {
         if (!bit_stream_.CanRead()) {
+            if (!source_->CanBorrow() && !marked_ && target.size() - read >= bit_stream_.buffer_size) {
+                // no point in copying through the buffer
+                ++io_calls_;
+                window_offset_ += buffer_current_size;
+                buffer_pointer = 0;
+                buffer_current_size = 0;
+                auto current = source_->Read(target.data() + read, target.size() - read);
+                window_offset_ += current;
+                read += current;
+                if (current == 0) {
+                    break;
+                }
+                continue;
+            }
             if (!FreeBuffer()) {
-                buffer_pointer = current_buffer_pointer;
-                bit_pointer = current_bit_pointer;
-                buffer_current_size = current_buffer_current_size;
-                return {0, false};
+                break;
             }
         }
-
-        Size current_read = 0;
-        if (count - read + bit_pointer <= CHAR_SIZE) {
-            current_read = count - read;
-        } else {
-            current_read = CHAR_SIZE - bit_pointer;
-        }
-        answer = answer << static_cast<ResultType>(current_read);
-        answer ^= BitStream::GetSubBits(buffer[buffer_pointer], bit_pointer, CHAR_SIZE - bit_pointer - current_read,
-                                        MAX_GET_REQUEST, CHAR_SIZE);
-
-        read += current_read;
-        bit_pointer += current_read;
-        while (bit_pointer >= CHAR_SIZE) {
-            ++buffer_pointer;
-            bit_pointer -= CHAR_SIZE;
-        }
+        auto current = std::min(target.size() - read, buffer_current_size - buffer_pointer);
+        std::copy_n(Data() + buffer_pointer, current, target.data() + read);
+        buffer_pointer += current;
+        read += current;
     }
-
-    return {answer, true};
+    return read;
 }
 void BitReader::Restore() {
-    input_.clear();
-    input_.seekg(std::ios::beg);
+    source_->Rewind();
+    borrowed_ = nullptr;
     bit_stream_.buffer_pointer = 0;
     bit_stream_.buffer_current_size = 0;
     bit_stream_.bit_pointer = 0;
+    accumulator_ = 0;
+    accumulator_size_ = 0;
+    window_offset_ = 0;
+    marked_ = false;
+}
+
+BitReader::Size BitReader::Refill() {
+    auto& buffer_pointer = bit_stream_.buffer_pointer;
+    auto& buffer_current_size = bit_stream_.buffer_current_size;
+
+    if (accumulator_size_ >= MAX_PEEK_REQUEST) {
+        return accumulator_size_;
+    }
+    if (buffer_pointer + sizeof(AccumulatorType) <= buffer_current_size) {
+        // Whole word load. Bits of the byte that does not fit get or-ed in too,
+        // they are exactly the bits the next refill puts there
+        accumulator_ |= BitStream::LoadBigEndian(Data() + buffer_pointer) >> accumulator_size_;
+        auto loaded = (ACCUMULATOR_SIZE - 1 - accumulator_size_) / CHAR_SIZE;
+        buffer_pointer += loaded;
+        accumulator_size_ += loaded * CHAR_SIZE;
+        return accumulator_size_;
+    }
+
+    while (accumulator_size_ <= MAX_PEEK_REQUEST) {
+        if (!bit_stream_.CanRead() && !FreeBuffer()) {
+            break;
+        }
+        auto byte = static_cast<AccumulatorType>(static_cast<uint8_t>(Data()[buffer_pointer]));
+        accumulator_ |= byte << (MAX_PEEK_REQUEST - accumulator_size_);
+        ++buffer_pointer;
+        accumulator_size_ += CHAR_SIZE;
+    }
+    return accumulator_size_;
+}
+
+void BitReader::SeekBits(Size offset) {
+    auto byte = offset / CHAR_SIZE;
+    if (window_offset_ <= byte && byte <= window_offset_ + bit_stream_.buffer_current_size) {
+        bit_stream_.buffer_pointer = byte - window_offset_;
+    } else {
+        SeekSource(byte);
+    }
+    accumulator_ = 0;
+    accumulator_size_ = 0;
+    if (offset % CHAR_SIZE != 0) {
+        Consume(std::min(Refill(), offset % CHAR_SIZE));
+    }
+}
+
+void BitReader::Mark() {
+    marked_ = true;
+    mark_ = {.accumulator = accumulator_,
+             .accumulator_size = accumulator_size_,
+             .next_byte = window_offset_ + bit_stream_.buffer_pointer};
+}
+void BitReader::Rewind() {
+    if (!marked_) {
+        throw std::logic_error("BitReader::Rewind without a mark");
+    }
+    // KeepMarked holds the marked bytes in the window, unless SeekBits went somewhere else
+    if (window_offset_ <= mark_.next_byte && mark_.next_byte <= window_offset_ + bit_stream_.buffer_current_size) {
+        bit_stream_.buffer_pointer = mark_.next_byte - window_offset_;
+    } else {
+        SeekSource(mark_.next_byte);
+    }
+    accumulator_ = mark_.accumulator;
+    accumulator_size_ = mark_.accumulator_size;
+}
+void BitReader::ReleaseMark() {
+    marked_ = false;
+}
+
+BitReader::Size BitReader::IoCalls() const {
+    return io_calls_;
+}
+BitReader::Size BitReader::SizeHint() const {
+    return source_->SizeHint();
+}
+BitReader::Size BitReader::ReadAt(Size offset, std::span<BitStream::CharType> target) const {
+    return source_->ReadAt(offset, target.data(), target.size());
+}
+bool BitReader::CanReadAt() const {
+    return source_->CanReadAt();
+}
+bool BitReader::CanRestore() const {
+    return source_->CanRewind();
+}
+bool BitReader::CanSeekBits() const {
+    return source_->CanSeek();
+}
+bool BitReader::InMemory() const {
+    return source_->InMemory();
 }
 
 bool BitReader::FreeBuffer() {
-    input_.read(bit_stream_.buffer, bit_stream_.BUFFER_SIZE);
-    bit_stream_.buffer_current_size = input_.gcount();
+    ++io_calls_;
+    auto window_size = bit_stream_.buffer_current_size;
+    auto kept = marked_ ? KeepMarked() : 0;
+    window_offset_ += window_size - kept;
+
+    if (kept != 0) {
+        auto& buffer_current_size = bit_stream_.buffer_current_size;
+        buffer_current_size = kept + source_->Read(bit_stream_.buffer.get() + kept, bit_stream_.buffer_size - kept);
+        bit_stream_.buffer_pointer = kept;
+        return buffer_current_size != kept;
+    }
+    if (source_->CanBorrow()) {
+        auto chunk = source_->Borrow(std::numeric_limits<Size>::max());
+        borrowed_ = chunk.data();
+        bit_stream_.buffer_current_size = chunk.size();
+    } else {
+        if (adaptive_ && bit_stream_.buffer_current_size == bit_stream_.buffer_size &&
+            bit_stream_.buffer_size < BitStream::MAX_BUFFER_SIZE) {
+            // The last read filled the whole buffer, the input is probably larger than it
+            bit_stream_.Resize(bit_stream_.buffer_size * 2);
+        }
+        bit_stream_.buffer_current_size = source_->Read(bit_stream_.buffer.get(), bit_stream_.buffer_size);
+    }
     bit_stream_.buffer_pointer = 0;
     bit_stream_.bit_pointer = 0;
 
@@ -71,3 +226,35 @@ bool BitReader::FreeBuffer() {
     }
     return true;
 }
+
+void BitReader::SeekSource(Size offset) {
+    source_->Seek(offset);
+    window_offset_ = offset;
+    borrowed_ = nullptr;
+    bit_stream_.buffer_pointer = 0;
+    bit_stream_.buffer_current_size = 0;
+}
+
+BitReader::Size BitReader::KeepMarked() {
+    if (mark_.next_byte < window_offset_ || mark_.next_byte > window_offset_ + bit_stream_.buffer_current_size) {
+        // SeekBits left the mark behind, Rewind will seek back to it
+        return 0;
+    }
+    auto start = mark_.next_byte - window_offset_;
+    auto kept = bit_stream_.buffer_current_size - start;
+    if (kept == 0) {
+        return 0;
+    }
+
+    if (bit_stream_.buffer_size < 2 * kept) {
+        // leave at least as much room for new bytes as is kept
+        BitStream larger(std::max(2 * kept, 2 * bit_stream_.buffer_size));
+        std::copy_n(Data() + start, kept, larger.buffer.get());
+        bit_stream_ = std::move(larger);
+    } else {
+        std::copy_n(Data() + start, kept, bit_stream_.buffer.get());
+    }
+    borrowed_ = nullptr;
+    bit_stream_.buffer_current_size = kept;
+    return kept;
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <cassert>
 #include <istream>
+#include <memory>
+#include <span>
 
 #include "bit_stream.h"
+#include "byte_source.h"
 
 class BitReader {
 public:
@@ -11,14 +15,102 @@ public:
     using ResultType = uint32_t;
     static const Size MAX_GET_REQUEST = 32;
 
+    using AccumulatorType = uint64_t;
+    static constexpr Size ACCUMULATOR_SIZE = 64;
+    static constexpr Size MAX_PEEK_REQUEST = ACCUMULATOR_SIZE - CHAR_SIZE;
+
     explicit BitReader(std::istream& input);
+    // With ADAPTIVE_BUFFER_SIZE the buffer is sized after the source's size hint and grows while reads fill it
+    explicit BitReader(std::unique_ptr<ByteSource> source, Size buffer_size = BitStream::ADAPTIVE_BUFFER_SIZE);
 
     std::pair<BitReader::ResultType, bool> ReadSome(size_t count);
+    // Reads whole bytes into `target` until it is full or the input ends. Returns the number of bytes read.
+    // Byte-aligned reads are copied straight from the buffer
+    Size ReadBytes(std::span<BitStream::CharType> target);
     void Restore();
 
+    // Tops the accumulator up to at least MAX_PEEK_REQUEST bits (less only at the end of input).
+    // Returns the number of bits available for Peek.
+    Size Refill();
+
+    // Next `count` bits (count <= MAX_PEEK_REQUEST) without consuming them.
+    // Bits past Available() are unspecified.
+    AccumulatorType Peek(Size count) const {
+        assert(count <= MAX_PEEK_REQUEST);
+        if (count == 0) {
+            return 0;
+        }
+        return accumulator_ >> (ACCUMULATOR_SIZE - count);
+    }
+    void Consume(Size count) {
+        assert(count <= accumulator_size_);
+        accumulator_ <<= count;
+        accumulator_size_ -= count;
+    }
+    Size Available() const {
+        return accumulator_size_;
+    }
+
+    // Position in bits from the beginning of the input
+    Size Tell() const {
+        return (window_offset_ + bit_stream_.buffer_pointer) * CHAR_SIZE - accumulator_size_;
+    }
+    // Skips the bits up to the next byte boundary
+    void Align() {
+        Consume(accumulator_size_ % CHAR_SIZE);
+    }
+    // Moves to the bit at `offset`. Stays within the buffer when it can, otherwise seeks the source.
+    // Seeking past the end leaves the reader at the end
+    void SeekBits(Size offset);
+
+    // Remembers the current position. Until ReleaseMark, bytes from it on are kept across buffer refills,
+    // so Rewind can always come back to it
+    void Mark();
+    void Rewind();
+    void ReleaseMark();
+
+    // Number of reads issued to the source so far
+    Size IoCalls() const;
+    // Size of the whole input if the source knows it, 0 otherwise
+    Size SizeHint() const;
+    // Reads whole bytes at `offset` of the input into `target`, without moving the reader. See ByteSource::ReadAt
+    Size ReadAt(Size offset, std::span<BitStream::CharType> target) const;
+    bool CanReadAt() const;
+    // Whether Restore works, see ByteSource::CanRewind
+    bool CanRestore() const;
+    // Whether SeekBits works for any offset, see ByteSource::CanSeek
+    bool CanSeekBits() const;
+    // Whether Restore and reading everything again cost no I/O, see ByteSource::InMemory
+    bool InMemory() const;
+
 private:
     bool FreeBuffer();
+    // Drops the buffer and reads from `offset` of the source on
+    void SeekSource(Size offset);
+    // Moves the marked bytes of the current window to the front of the buffer. Returns how many were kept
+    Size KeepMarked();
+    const BitStream::CharType* Data() const {
+        return borrowed_ != nullptr ? borrowed_ : bit_stream_.buffer.get();
+    }
 
     BitStream bit_stream_;
-    std::istream& input_;
+    std::unique_ptr<ByteSource> source_;
+    // Current bytes when they are borrowed from the source instead of copied into bit_stream_.buffer
+    const BitStream::CharType* borrowed_ = nullptr;
+    bool adaptive_;
+    Size io_calls_ = 0;
+
+    // Position of the first byte of the current window in the whole input
+    Size window_offset_ = 0;
+
+    struct Checkpoint {
+        AccumulatorType accumulator = 0;
+        Size accumulator_size = 0;
+        Size next_byte = 0;  // the byte that follows the accumulator, as an offset in the whole input
+    };
+    bool marked_ = false;
+    Checkpoint mark_;
+
+    AccumulatorType accumulator_ = 0;  // Next bits of the stream, MSB first
+    Size accumulator_size_ = 0;
 };
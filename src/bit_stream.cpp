@@ -1,8 +1,16 @@
 #include "bit_stream.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
 using Size = typename BitStream::Size;
 using ResultType = typename BitStream::ResultType;
 
+BitStream::BitStream(Size size) {
+    Resize(size);
+}
+
 bool BitStream::CanRead() const {
     return (buffer_pointer < buffer_current_size);
 }
@@ -12,3 +20,42 @@ ResultType BitStream::GetSubBits(ResultType element, Size left_offset, Size righ
     auto answer = without_left >> (max_size - current_size + left_offset + right_offset);
     return answer;
 }
+uint64_t BitStream::LoadBigEndian(const CharType* data) {
+    uint64_t answer = 0;
+    for (Size i = 0; i < sizeof(answer); ++i) {
+        answer = (answer << CHAR_SIZE) | static_cast<uint8_t>(data[i]);
+    }
+    return answer;
+}
+void BitStream::StoreBigEndian(CharType* data, uint64_t value) {
+    for (Size i = sizeof(value); i > 0; --i) {
+        data[i - 1] = static_cast<CharType>(value);
+        value >>= CHAR_SIZE;
+    }
+}
+
+Size BitStream::AdaptiveBufferSize(Size size_hint) {
+    if (size_hint == 0) {
+        return DEFAULT_BUFFER_SIZE;
+    }
+    // one byte more, so that the read hitting the end does not look like a full buffer
+    return std::clamp(size_hint + 1, MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+}
+
+void BitStream::Resize(Size size) {
+    size = std::max(size, MIN_BUFFER_SIZE);
+    auto capacity = (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    auto data = static_cast<CharType*>(std::aligned_alloc(PAGE_SIZE, capacity));
+    if (data == nullptr) {
+        throw std::bad_alloc();
+    }
+    buffer.reset(data);
+    buffer_size = size;
+    buffer_pointer = 0;
+    bit_pointer = 0;
+    buffer_current_size = 0;
+}
+
+void BitStream::AlignedDeleter::operator()(CharType* data) const {
+    std::free(data);
+}
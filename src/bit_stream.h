@@ -3,6 +3,7 @@
 #include <bitset>
 #include <limits>
 #include <cstdint>
+#include <memory>
 
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
@@ -14,12 +15,34 @@ struct BitStream {
     static const Size CHAR_SIZE = CHAR_BIT;
     using ResultType = uint32_t;
 
+    static constexpr Size PAGE_SIZE = 4096;
+    static constexpr Size MIN_BUFFER_SIZE = 64;
+    static constexpr Size DEFAULT_BUFFER_SIZE = 1 << 16;
+    static constexpr Size MAX_BUFFER_SIZE = 1 << 22;
+    // Passed as a buffer size, lets the stream pick and grow the buffer itself
+    static constexpr Size ADAPTIVE_BUFFER_SIZE = 0;
+
+    explicit BitStream(Size size = DEFAULT_BUFFER_SIZE);
+
     bool CanRead() const;
     static ResultType GetSubBits(ResultType element, Size left_offset, Size right_offset, Size max_size,
                                  Size current_size);
+    // First 8 bytes at `data` as one word, the first byte being the most significant
+    static uint64_t LoadBigEndian(const CharType* data);
+    static void StoreBigEndian(CharType* data, uint64_t value);
+
+    // Buffer size for a stream of `size_hint` bytes (0 if unknown)
+    static Size AdaptiveBufferSize(Size size_hint);
+
+    // Reallocates the buffer to hold `size` bytes, the contents are dropped
+    void Resize(Size size);
+
+    struct AlignedDeleter {
+        void operator()(CharType* data) const;
+    };
 
-    static const Size BUFFER_SIZE = 1024;
-    CharType buffer[BUFFER_SIZE] = {};  // Has symbols(bytes) in little-endian
+    std::unique_ptr<CharType[], AlignedDeleter> buffer;  // PAGE_SIZE aligned, has symbols(bytes) in little-endian
+    Size buffer_size = 0;
     Size buffer_pointer = 0;
     Size bit_pointer = 0;
     Size buffer_current_size = 0;
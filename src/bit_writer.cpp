@@ -1,7 +1,13 @@
 #include "bit_writer.h"
 
-BitWriter::BitWriter(std::ostream& output) : bit_stream_(), output_(output) {
-    bit_stream_.buffer_current_size = bit_stream_.BUFFER_SIZE;
+#include <algorithm>
+
+BitWriter::BitWriter(std::ostream& output) : BitWriter(std::make_unique<StreamSink>(output)) {
+}
+BitWriter::BitWriter(std::unique_ptr<ByteSink> sink, Size buffer_size)
+    : bit_stream_(buffer_size == BitStream::ADAPTIVE_BUFFER_SIZE ? BitStream::DEFAULT_BUFFER_SIZE : buffer_size),
+      sink_(std::move(sink)),
+      adaptive_(buffer_size == BitStream::ADAPTIVE_BUFFER_SIZE) {
 }
 
 void BitWriter::WriteSome(BitWriter::InputType target, BitStream::Size size) {
@@ -11,58 +17,100 @@ void BitWriter::WriteSome(BitWriter::InputType target, BitStream::Size size) {
                                   ". That overflows current result type = " + typeid(InputType).name() + "!");
     }
 
-    auto& buffer = bit_stream_.buffer;
+    auto mask = (static_cast<AccumulatorType>(1) << size) - 1;
+    Append(target & mask, size);
+}
+void BitWriter::WriteBytes(std::span<const BitStream::CharType> data) {
     auto& buffer_pointer = bit_stream_.buffer_pointer;
-    auto& bit_pointer = bit_stream_.bit_pointer;
 
-    Size put = 0;
-    while (put < size) {
-        if (!bit_stream_.CanRead()) {
-            FreeBuffer();
+    if (accumulator_size_ % CHAR_SIZE != 0) {
+        Size i = 0;
+        for (; i + sizeof(AccumulatorType) <= data.size(); i += sizeof(AccumulatorType) - 1) {
+            Append(BitStream::LoadBigEndian(data.data() + i) >> CHAR_SIZE, MAX_APPEND_REQUEST);
         }
-
-        Size current_put = 0;
-        if (size - put + bit_pointer <= CHAR_SIZE) {
-            current_put = size - put;
-        } else {
-            current_put = CHAR_SIZE - bit_pointer;
+        for (; i < data.size(); ++i) {
+            Append(static_cast<uint8_t>(data[i]), CHAR_SIZE);
         }
+        return;
+    }
 
-        auto& copy = buffer[buffer_pointer];
-        copy <<= current_put;                                                                         // NOLINT
-        copy += BitStream::GetSubBits(target, put, size - put - current_put, MAX_PUT_REQUEST, size);  // NOLINT
-
-        put += current_put;
-        bit_pointer += current_put;
-        while (bit_pointer >= CHAR_SIZE) {
-            ++buffer_pointer;
-            bit_pointer -= CHAR_SIZE;
+    Drain();
+    Size written = 0;
+    while (written < data.size()) {
+        if (buffer_pointer == bit_stream_.buffer_size) {
+            FreeBuffer();
         }
+        auto current = std::min(data.size() - written, bit_stream_.buffer_size - buffer_pointer);
+        std::copy_n(data.data() + written, current, bit_stream_.buffer.get() + buffer_pointer);
+        buffer_pointer += current;
+        written += current;
     }
 }
 void BitWriter::Flush() {
     auto& buffer = bit_stream_.buffer;
-    auto& bit_pointer = bit_stream_.bit_pointer;
+    auto& buffer_pointer = bit_stream_.buffer_pointer;
 
+    Drain();
+    if (accumulator_size_ != 0) {
+        if (buffer_pointer == bit_stream_.buffer_size) {
+            FreeBuffer();
+        }
+        // the last byte is padded with zeros
+        buffer[buffer_pointer++] = static_cast<BitStream::CharType>(accumulator_ << (CHAR_SIZE - accumulator_size_));
+    }
     FreeBuffer();
-    if (bit_pointer != 0) {
-        buffer[0] <<= (BitWriter::CHAR_SIZE - bit_pointer);  // NOLINT
-        output_ << buffer[0];
-        buffer[0] = 0;
-        bit_pointer = 0;
+    sink_->Flush();
+    accumulator_ = 0;
+    accumulator_size_ = 0;
+}
+
+void BitWriter::Drain() {
+    auto& buffer_pointer = bit_stream_.buffer_pointer;
+
+    while (accumulator_size_ >= CHAR_SIZE) {
+        if (buffer_pointer == bit_stream_.buffer_size) {
+            FreeBuffer();
+        }
+        accumulator_size_ -= CHAR_SIZE;
+        bit_stream_.buffer[buffer_pointer++] = static_cast<BitStream::CharType>(accumulator_ >> accumulator_size_);
+    }
+}
+
+void BitWriter::Spill(AccumulatorType code, Size size) {
+    auto& buffer_pointer = bit_stream_.buffer_pointer;
+
+    auto free = ACCUMULATOR_SIZE - accumulator_size_;
+    auto left = size - free;
+    auto word = (accumulator_ << free) | (code >> left);
+
+    if (buffer_pointer + sizeof(word) > bit_stream_.buffer_size) {
+        FreeBuffer();
     }
+    BitStream::StoreBigEndian(bit_stream_.buffer.get() + buffer_pointer, word);
+    buffer_pointer += sizeof(word);
+
+    accumulator_ = code;
+    accumulator_size_ = left;
+}
+
+BitWriter::Size BitWriter::IoCalls() const {
+    return io_calls_;
 }
 
 void BitWriter::FreeBuffer() {
-    auto& buffer = bit_stream_.buffer;
     auto& buffer_pointer = bit_stream_.buffer_pointer;
 
     if (buffer_pointer == 0) {
         return;
     }
 
-    output_.write(buffer, buffer_pointer);
-
-    std::swap(buffer[0], buffer[buffer_pointer]);
-    buffer_pointer = 0;
+    ++io_calls_;
+    auto was_full = buffer_pointer + sizeof(AccumulatorType) > bit_stream_.buffer_size;
+    written_ += buffer_pointer;
+    sink_->Submit(bit_stream_);
+    if (adaptive_ && was_full && bit_stream_.buffer_size < BitStream::MAX_BUFFER_SIZE) {
+        // The output is probably larger than the buffer
+        bit_stream_.Resize(bit_stream_.buffer_size * 2);
+    }
+    bit_stream_.buffer_pointer = 0;
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <memory>
 #include <ostream>
+#include <span>
 
 #include "bit_stream.h"
+#include "byte_sink.h"
 
 class BitWriter {
 public:
@@ -11,14 +14,54 @@ public:
     using InputType = uint32_t;
     static const Size MAX_PUT_REQUEST = 32;
 
+    using AccumulatorType = uint64_t;
+    static constexpr Size ACCUMULATOR_SIZE = 64;
+    static constexpr Size MAX_APPEND_REQUEST = ACCUMULATOR_SIZE - CHAR_SIZE;
+
     explicit BitWriter(std::ostream& output);
+    // With ADAPTIVE_BUFFER_SIZE the buffer starts at DEFAULT_BUFFER_SIZE and grows while it keeps filling up
+    explicit BitWriter(std::unique_ptr<ByteSink> sink, Size buffer_size = BitStream::ADAPTIVE_BUFFER_SIZE);
 
     void WriteSome(InputType target, Size size);
+    // Writes whole bytes. When the output is byte-aligned they are copied straight into the buffer
+    void WriteBytes(std::span<const BitStream::CharType> data);
     void Flush();
 
+    // Appends `size` (<= MAX_APPEND_REQUEST) low bits of `code`, MSB first. Higher bits of `code` must be zero.
+    void Append(AccumulatorType code, Size size) {
+        if (accumulator_size_ + size < ACCUMULATOR_SIZE) {
+            accumulator_ = (accumulator_ << size) | code;
+            accumulator_size_ += size;
+            return;
+        }
+        Spill(code, size);
+    }
+
+    // Position in bits from the beginning of the output
+    Size Tell() const {
+        return (written_ + bit_stream_.buffer_pointer) * CHAR_SIZE + accumulator_size_;
+    }
+    // Pads the output with zero bits up to a byte boundary
+    void Align() {
+        Append(0, (CHAR_SIZE - accumulator_size_ % CHAR_SIZE) % CHAR_SIZE);
+    }
+
+    // Number of writes issued to the sink so far
+    Size IoCalls() const;
+
 private:
+    // Moves whole bytes of the accumulator into the buffer
+    void Drain();
+    void Spill(AccumulatorType code, Size size);
     void FreeBuffer();
 
     BitStream bit_stream_;
-    std::ostream& output_;
+    std::unique_ptr<ByteSink> sink_;
+    bool adaptive_;
+    Size io_calls_ = 0;
+    Size written_ = 0;  // bytes handed to the sink
+
+    // Last `accumulator_size_` bits are pending output, bits above them are garbage
+    AccumulatorType accumulator_ = 0;
+    Size accumulator_size_ = 0;
 };
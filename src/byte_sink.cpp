@@ -0,0 +1,69 @@
+#include "byte_sink.h"
+
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using Size = ByteSink::Size;
+using CharType = ByteSink::CharType;
+
+void ByteSink::Submit(BitStream& stream) {
+    Write(stream.buffer.get(), stream.buffer_pointer);
+}
+void ByteSink::Flush() {
+}
+
+StreamSink::StreamSink(std::ostream& output) : output_(output) {
+}
+
+void StreamSink::Write(const CharType* data, Size size) {
+    output_.write(data, static_cast<std::streamsize>(size));
+}
+void StreamSink::Flush() {
+    output_.flush();
+}
+
+FileStreamSink::FileStreamSink(const std::string& path)
+    : FileStreamSink(std::make_unique<std::ofstream>(path, std::ios_base::binary)) {
+    if (!file_->is_open()) {
+        throw std::system_error(errno, std::generic_category(), "can't open: " + path);
+    }
+}
+FileStreamSink::FileStreamSink(std::unique_ptr<std::ofstream> file) : StreamSink(*file), file_(std::move(file)) {
+}
+
+FdSink::FdSink(const std::string& path) : fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)), owns_fd_(true) {
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), "can't open: " + path);
+    }
+}
+FdSink::FdSink(int fd) : fd_(fd), owns_fd_(false) {
+}
+FdSink::~FdSink() {
+    if (owns_fd_) {
+        close(fd_);
+    }
+}
+
+void FdSink::Write(const CharType* data, Size size) {
+    Size total = 0;
+    while (total < size) {
+        auto current = write(fd_, data + total, size - total);
+        if (current < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "FdSink::Write");
+        }
+        total += current;
+    }
+}
+
+MemorySink::MemorySink(std::vector<CharType>& output) : output_(output) {
+}
+
+void MemorySink::Write(const CharType* data, Size size) {
+    output_.insert(output_.end(), data, data + size);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "bit_stream.h"
+
+// Where BitWriter puts its bytes
+class ByteSink {
+public:
+    using Size = BitStream::Size;
+    using CharType = BitStream::CharType;
+
+    virtual ~ByteSink() = default;
+
+    virtual void Write(const CharType* data, Size size) = 0;
+    // Takes the first `stream.buffer_pointer` bytes of the stream's buffer. The sink may swap in another buffer
+    // for the stream to go on with. By default the bytes are written right away and the buffer stays
+    virtual void Submit(BitStream& stream);
+    // Pushes everything written so far to the destination
+    virtual void Flush();
+};
+
+class StreamSink : public ByteSink {
+public:
+    explicit StreamSink(std::ostream& output);
+
+    void Write(const CharType* data, Size size) override;
+    void Flush() override;
+
+private:
+    std::ostream& output_;
+};
+
+// StreamSink over a file it owns
+class FileStreamSink : public StreamSink {
+public:
+    // Creates or truncates the file
+    explicit FileStreamSink(const std::string& path);
+
+private:
+    explicit FileStreamSink(std::unique_ptr<std::ofstream> file);
+
+    std::unique_ptr<std::ofstream> file_;
+};
+
+// Writes straight to a file descriptor with write(2)
+class FdSink : public ByteSink {
+public:
+    // Creates or truncates the file
+    explicit FdSink(const std::string& path);
+    // Does not take ownership of `fd`
+    explicit FdSink(int fd);
+    FdSink(const FdSink& other) = delete;
+    FdSink& operator=(const FdSink& other) = delete;
+    ~FdSink() override;
+
+    void Write(const CharType* data, Size size) override;
+
+private:
+    int fd_;
+    bool owns_fd_;
+};
+
+// Appends to a vector owned by the caller
+class MemorySink : public ByteSink {
+public:
+    explicit MemorySink(std::vector<CharType>& output);
+
+    void Write(const CharType* data, Size size) override;
+
+private:
+    std::vector<CharType>& output_;
+};
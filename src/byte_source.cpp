@@ -0,0 +1,245 @@
+#include "byte_source.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using Size = ByteSource::Size;
+using CharType = ByteSource::CharType;
+
+Size ByteSource::ReadAt(Size, CharType*, Size) const {
+    throw std::logic_error("the source can only be read in order");
+}
+bool ByteSource::CanReadAt() const {
+    return false;
+}
+std::span<const CharType> ByteSource::Borrow(Size) {
+    return {};
+}
+bool ByteSource::CanBorrow() const {
+    return false;
+}
+void ByteSource::Seek(Size offset) {
+    if (offset != 0) {
+        throw std::logic_error("the source can only rewind");
+    }
+    Rewind();
+}
+Size ByteSource::SizeHint() const {
+    return 0;
+}
+bool ByteSource::CanRewind() const {
+    return true;
+}
+bool ByteSource::CanSeek() const {
+    return false;
+}
+bool ByteSource::InMemory() const {
+    return false;
+}
+
+StreamSource::StreamSource(std::istream& input) : input_(input) {
+}
+
+Size StreamSource::Read(CharType* buffer, Size size) {
+    input_.read(buffer, static_cast<std::streamsize>(size));
+    return input_.gcount();
+}
+void StreamSource::Rewind() {
+    input_.clear();
+    input_.seekg(std::ios::beg);
+}
+void StreamSource::Seek(Size offset) {
+    input_.clear();
+    input_.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    if (input_.fail()) {
+        // past the end, as far as some streams are concerned
+        input_.clear();
+        input_.seekg(0, std::ios::end);
+    }
+    if (input_.fail()) {
+        throw std::runtime_error("StreamSource::Seek failed");
+    }
+}
+bool StreamSource::CanRewind() const {
+    return CanSeek();
+}
+bool StreamSource::CanSeek() const {
+    // straight to the buffer, so that the stream state stays as it is
+    return input_.rdbuf()->pubseekoff(0, std::ios::cur, std::ios::in) != std::streampos(-1);
+}
+
+FileStreamSource::FileStreamSource(const std::string& path)
+    : FileStreamSource(std::make_unique<std::ifstream>(path, std::ios_base::binary)) {
+    if (!file_->is_open()) {
+        throw std::system_error(errno, std::generic_category(), "can't open: " + path);
+    }
+    std::error_code error;
+    auto size = std::filesystem::file_size(path, error);
+    if (!error) {
+        size_hint_ = size;
+    }
+}
+FileStreamSource::FileStreamSource(std::unique_ptr<std::ifstream> file) : StreamSource(*file), file_(std::move(file)) {
+}
+
+Size FileStreamSource::SizeHint() const {
+    return size_hint_;
+}
+
+FdSource::FdSource(const std::string& path) : fd_(open(path.c_str(), O_RDONLY)), owns_fd_(true) {
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), "can't open: " + path);
+    }
+}
+FdSource::FdSource(int fd) : fd_(fd), owns_fd_(false) {
+}
+FdSource::~FdSource() {
+    if (owns_fd_) {
+        close(fd_);
+    }
+}
+
+Size FdSource::Read(CharType* buffer, Size size) {
+    Size total = 0;
+    while (total < size) {
+        auto current = read(fd_, buffer + total, size - total);
+        if (current < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "FdSource::Read");
+        }
+        if (current == 0) {
+            break;
+        }
+        total += current;
+    }
+    return total;
+}
+Size FdSource::ReadAt(Size offset, CharType* buffer, Size size) const {
+    Size total = 0;
+    while (total < size) {
+        auto current = pread(fd_, buffer + total, size - total, static_cast<off_t>(offset + total));
+        if (current < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "FdSource::ReadAt");
+        }
+        if (current == 0) {
+            break;
+        }
+        total += current;
+    }
+    return total;
+}
+bool FdSource::CanReadAt() const {
+    return CanSeek();
+}
+void FdSource::Rewind() {
+    Seek(0);
+}
+void FdSource::Seek(Size offset) {
+    if (lseek(fd_, static_cast<off_t>(offset), SEEK_SET) < 0) {
+        throw std::system_error(errno, std::generic_category(), "FdSource::Seek");
+    }
+}
+
+Size FdSource::SizeHint() const {
+    struct stat info = {};
+    if (fstat(fd_, &info) < 0 || !S_ISREG(info.st_mode)) {
+        return 0;
+    }
+    return info.st_size;
+}
+bool FdSource::CanRewind() const {
+    return CanSeek();
+}
+bool FdSource::CanSeek() const {
+    return lseek(fd_, 0, SEEK_CUR) >= 0;
+}
+
+MemorySource::MemorySource(std::span<const CharType> data) : data_(data), position_(0) {
+}
+
+Size MemorySource::Read(CharType* buffer, Size size) {
+    auto chunk = Borrow(size);
+    std::copy(chunk.begin(), chunk.end(), buffer);
+    return chunk.size();
+}
+Size MemorySource::ReadAt(Size offset, CharType* buffer, Size size) const {
+    auto chunk = data_.subspan(std::min(offset, data_.size()));
+    chunk = chunk.first(std::min(size, chunk.size()));
+    std::copy(chunk.begin(), chunk.end(), buffer);
+    return chunk.size();
+}
+bool MemorySource::CanReadAt() const {
+    return true;
+}
+std::span<const CharType> MemorySource::Borrow(Size max_size) {
+    auto chunk = data_.subspan(position_, std::min(max_size, data_.size() - position_));
+    position_ += chunk.size();
+    return chunk;
+}
+bool MemorySource::CanBorrow() const {
+    return true;
+}
+void MemorySource::Rewind() {
+    position_ = 0;
+}
+void MemorySource::Seek(Size offset) {
+    position_ = std::min(offset, data_.size());
+}
+Size MemorySource::SizeHint() const {
+    return data_.size();
+}
+bool MemorySource::CanSeek() const {
+    return true;
+}
+bool MemorySource::InMemory() const {
+    return true;
+}
+
+MmapSource::MmapSource(const std::string& path) : MemorySource({}) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "can't open: " + path);
+    }
+    struct stat info = {};
+    if (fstat(fd, &info) < 0) {
+        auto error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "can't stat: " + path);
+    }
+    // a pipe or a terminal has no size to map, st_size 0 would read as an empty file
+    if (!S_ISREG(info.st_mode)) {
+        close(fd);
+        throw std::system_error(ENODEV, std::generic_category(), "can't mmap: " + path);
+    }
+    if (info.st_size != 0) {
+        auto size = static_cast<Size>(info.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            auto error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "can't mmap: " + path);
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        data_ = {static_cast<const CharType*>(data), size};
+    }
+    close(fd);
+}
+MmapSource::~MmapSource() {
+    if (!data_.empty()) {
+        munmap(const_cast<CharType*>(data_.data()), data_.size());
+    }
+}
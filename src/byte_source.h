@@ -0,0 +1,125 @@
+#pragma once
+
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <span>
+#include <string>
+
+#include "bit_stream.h"
+
+// Where BitReader takes its bytes from
+class ByteSource {
+public:
+    using Size = BitStream::Size;
+    using CharType = BitStream::CharType;
+
+    virtual ~ByteSource() = default;
+
+    // Copies at most `size` next bytes into `buffer`. Returns the number of bytes copied, 0 at the end of input
+    virtual Size Read(CharType* buffer, Size size) = 0;
+    // Next at most `max_size` bytes without copying, if the source already has them in memory.
+    // Returns an empty span when borrowing is not supported or the input has ended.
+    // The span stays valid until the next call to the source
+    virtual std::span<const CharType> Borrow(Size max_size);
+    virtual bool CanBorrow() const;
+    // Copies at most `size` bytes from `offset` on into `buffer`, without moving the source. Safe to call from several
+    // threads at once, when CanReadAt. Returns the number of bytes copied, 0 past the end of input
+    virtual Size ReadAt(Size offset, CharType* buffer, Size size) const;
+    virtual bool CanReadAt() const;
+    // Moves back to the first byte
+    virtual void Rewind() = 0;
+    // Moves to the byte at `offset`. Sources that can only rewind throw std::logic_error for other offsets
+    virtual void Seek(Size offset);
+    // Total number of bytes if it is known up front, 0 otherwise
+    virtual Size SizeHint() const;
+    // Whether Rewind works. Pipes and terminals can only be read once
+    virtual bool CanRewind() const;
+    // Whether Seek works for any offset, not only 0
+    virtual bool CanSeek() const;
+    // Whether all the bytes are in memory already, so reading them again costs no I/O
+    virtual bool InMemory() const;
+};
+
+class StreamSource : public ByteSource {
+public:
+    explicit StreamSource(std::istream& input);
+
+    Size Read(CharType* buffer, Size size) override;
+    void Rewind() override;
+    void Seek(Size offset) override;
+    bool CanRewind() const override;
+    bool CanSeek() const override;
+
+private:
+    std::istream& input_;
+};
+
+// StreamSource over a file it owns
+class FileStreamSource : public StreamSource {
+public:
+    explicit FileStreamSource(const std::string& path);
+
+    Size SizeHint() const override;
+
+private:
+    explicit FileStreamSource(std::unique_ptr<std::ifstream> file);
+
+    std::unique_ptr<std::ifstream> file_;
+    Size size_hint_ = 0;
+};
+
+// Reads straight from a file descriptor with read(2)
+class FdSource : public ByteSource {
+public:
+    explicit FdSource(const std::string& path);
+    // Does not take ownership of `fd`
+    explicit FdSource(int fd);
+    FdSource(const FdSource& other) = delete;
+    FdSource& operator=(const FdSource& other) = delete;
+    ~FdSource() override;
+
+    Size Read(CharType* buffer, Size size) override;
+    // with pread(2)
+    Size ReadAt(Size offset, CharType* buffer, Size size) const override;
+    bool CanReadAt() const override;
+    void Rewind() override;
+    void Seek(Size offset) override;
+    Size SizeHint() const override;
+    bool CanRewind() const override;
+    bool CanSeek() const override;
+
+private:
+    int fd_;
+    bool owns_fd_;
+};
+
+// Bytes that are already in memory. The memory must outlive the source
+class MemorySource : public ByteSource {
+public:
+    explicit MemorySource(std::span<const CharType> data);
+
+    Size Read(CharType* buffer, Size size) override;
+    Size ReadAt(Size offset, CharType* buffer, Size size) const override;
+    bool CanReadAt() const override;
+    std::span<const CharType> Borrow(Size max_size) override;
+    bool CanBorrow() const override;
+    void Rewind() override;
+    void Seek(Size offset) override;
+    Size SizeHint() const override;
+    bool CanSeek() const override;
+    bool InMemory() const override;
+
+protected:
+    std::span<const CharType> data_;
+    Size position_;
+};
+
+// Maps the whole file into memory with mmap(2). Only regular files can be mapped, others throw std::system_error
+class MmapSource : public MemorySource {
+public:
+    explicit MmapSource(const std::string& path);
+    MmapSource(const MmapSource& other) = delete;
+    MmapSource& operator=(const MmapSource& other) = delete;
+    ~MmapSource() override;
+};
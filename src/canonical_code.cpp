@@ -0,0 +1,93 @@
+#include "canonical_code.h"
+
+#include <algorithm>
+
+CanonicalCode::CanonicalCode(const Lengths& lengths) {
+    for (Symbol symbol = 0; symbol < ALPHABET_SIZE; ++symbol) {
+        auto length = lengths[symbol];
+        if (length == 0) {
+            continue;
+        }
+        symbols_.push_back(symbol);
+        entries_[symbol].length = length;
+        if (length_counts_.size() < length) {
+            length_counts_.resize(length);
+        }
+        ++length_counts_[length - 1];
+    }
+    std::stable_sort(symbols_.begin(), symbols_.end(),
+                     [this](Symbol a, Symbol b) { return entries_[a].length < entries_[b].length; });
+    AssignCodes();
+}
+
+CanonicalCode::CanonicalCode(std::vector<Symbol> symbols, std::vector<size_t> length_counts)
+    : symbols_(std::move(symbols)), length_counts_(std::move(length_counts)) {
+    auto symbol = symbols_.begin();
+    for (size_t length = 1; length <= length_counts_.size(); ++length) {
+        for (size_t i = 0; i < length_counts_[length - 1] && symbol != symbols_.end(); ++i, ++symbol) {
+            assert(*symbol < ALPHABET_SIZE);
+            entries_[*symbol].length = length;
+        }
+    }
+    AssignCodes();
+}
+
+CanonicalCode::Symbol CanonicalCode::DecodeLong(BitReader& input) const {
+    // The codes of each length are [first, first + count). Arithmetic is modulo 2^CODE_SIZE,
+    // which is enough since long codes only differ in their low bits
+    CodeType code = 0;
+    CodeType first = 0;
+    size_t index = 0;
+    size_t length = 0;
+
+    while (true) {
+        auto available = input.Refill();
+        if (available == 0) {
+            return NO_SYMBOL;
+        }
+        auto count = std::min(available, BitReader::MAX_PEEK_REQUEST);
+        auto bits = input.Peek(count);
+
+        for (size_t used = 1; used <= count; ++used) {
+            if (++length > length_counts_.size()) {
+                return NO_SYMBOL;
+            }
+            code |= (bits >> (count - used)) & 1;
+            auto number = length_counts_[length - 1];
+            if (code - first < number) {
+                input.Consume(used);
+                return symbols_[index + (code - first)];
+            }
+            index += number;
+            first = (first + number) << 1;
+            code <<= 1;
+        }
+        input.Consume(count);
+    }
+}
+
+void CanonicalCode::AssignCodes() {
+    CodeType code = 0;
+    size_t length = 0;
+    for (auto symbol : symbols_) {
+        auto& entry = entries_[symbol];
+        auto shift = entry.length - length;
+        code = shift < CODE_SIZE ? code << shift : 0;
+        entry.code = code++;
+        length = entry.length;
+    }
+
+    lookup_.assign(size_t(1) << LOOKUP_BITS, {});
+    for (auto symbol : symbols_) {
+        const auto& entry = entries_[symbol];
+        if (entry.length > LOOKUP_BITS) {
+            break;
+        }
+        // every index that starts with the code
+        auto first = entry.code << (LOOKUP_BITS - entry.length);
+        auto last = std::min(lookup_.size(), (entry.code + 1) << (LOOKUP_BITS - entry.length));
+        for (auto i = first; i < last; ++i) {
+            lookup_[i] = {.symbol = static_cast<uint16_t>(symbol), .length = static_cast<uint16_t>(entry.length)};
+        }
+    }
+}
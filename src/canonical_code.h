@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "bit_reader.h"
+
+// Canonical Huffman code: codes of the same length are consecutive numbers, in the order of their symbols,
+// and each length starts right after the codes of the previous one. Only the symbols in (length, symbol) order
+// and the number of codes of each length need to be stored in the archive.
+class CanonicalCode {
+public:
+    static constexpr size_t ALPHABET_SIZE = 259;
+    using Symbol = uint32_t;
+    static constexpr Symbol NO_SYMBOL = ALPHABET_SIZE;
+
+    using CodeType = uint64_t;
+    static constexpr size_t CODE_SIZE = 64;
+    // Codes up to this long are decoded with a single table lookup
+    static constexpr size_t LOOKUP_BITS = 11;
+
+    struct Entry {
+        // Low CODE_SIZE bits of the code. Longer codes are all ones above them
+        CodeType code = 0;
+        size_t length = 0;
+    };
+    using Lengths = std::array<size_t, ALPHABET_SIZE>;
+
+    CanonicalCode() = default;
+    // Code lengths are indexed by symbol, 0 for the symbols without a code
+    explicit CanonicalCode(const Lengths& lengths);
+    // `symbols` in canonical order, `length_counts[i]` of them have codes of length i + 1
+    CanonicalCode(std::vector<Symbol> symbols, std::vector<size_t> length_counts);
+
+    const Entry& operator[](Symbol symbol) const {
+        assert(symbol < ALPHABET_SIZE);
+        return entries_[symbol];
+    }
+    const std::vector<Symbol>& Symbols() const {
+        return symbols_;
+    }
+    // Number of codes of each length, starting from length 1
+    const std::vector<size_t>& LengthCounts() const {
+        return length_counts_;
+    }
+
+    // Reads one code. Returns NO_SYMBOL if the input ends first or the bits are not a code
+    Symbol Decode(BitReader& input) const {
+        if (input.Refill() >= LOOKUP_BITS) {
+            auto entry = lookup_[input.Peek(LOOKUP_BITS)];
+            if (entry.length != 0) {
+                input.Consume(entry.length);
+                return entry.symbol;
+            }
+        }
+        return DecodeLong(input);
+    }
+
+private:
+    struct LookupEntry {
+        uint16_t symbol = 0;
+        uint16_t length = 0;  // 0 if the code is longer than LOOKUP_BITS
+    };
+
+    void AssignCodes();
+    // Bit by bit, for the codes longer than LOOKUP_BITS and at the end of input
+    Symbol DecodeLong(BitReader& input) const;
+
+    std::array<Entry, ALPHABET_SIZE> entries_{};
+    std::vector<Symbol> symbols_;
+    std::vector<size_t> length_counts_;
+    std::vector<LookupEntry> lookup_;
+};
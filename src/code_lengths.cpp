@@ -0,0 +1,203 @@
+#include "code_lengths.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "heap.h"
+#include "trie.h"
+
+CanonicalCode::Lengths CodeLengths::Build(const Frequencies& frequencies, Builder builder) {
+    if (builder == Builder::IN_PLACE) {
+        return InPlace(frequencies);
+    }
+    return FromTrie(frequencies);
+}
+
+CanonicalCode::Lengths CodeLengths::FromTrie(const Frequencies& frequencies) {
+    using QueueKey = std::pair<FrequencyType, Trie<size_t>>;
+    using Code = std::pair<size_t, std::vector<bool>>;
+
+    CanonicalCode::Lengths lengths{};
+    MinHeap<QueueKey> priority_queue;
+    for (size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i] == 0) {
+            continue;
+        }
+        QueueKey current(frequencies[i], Trie<size_t>(i));
+        priority_queue.Insert(std::move(current));
+    }
+    if (priority_queue.Size() == 0) {
+        return lengths;
+    }
+
+    while (priority_queue.Size() > 1) {
+        auto l = priority_queue.Extract();
+        auto r = priority_queue.Extract();
+        QueueKey current(l.first + r.first, Trie<size_t>(std::move(l.second), std::move(r.second)));
+        priority_queue.Insert(std::move(current));
+    }
+
+    auto trie = priority_queue.Extract().second;
+    std::vector<Code> codes;
+    trie.GenerateCodes(codes);
+    for (const auto& [key, code] : codes) {
+        lengths[key] = std::max<size_t>(code.size(), 1);
+    }
+    return lengths;
+}
+
+CanonicalCode::Lengths CodeLengths::InPlace(const Frequencies& frequencies) {
+    // A. Moffat, J. Katajainen, "In-Place Calculation of Minimum-Redundancy Codes", 1995.
+    // `weight` goes from frequencies to parent indices to depths without any other storage
+    std::array<std::pair<FrequencyType, size_t>, CanonicalCode::ALPHABET_SIZE> sorted;
+    size_t n = 0;
+    for (size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i] != 0) {
+            sorted[n++] = {frequencies[i], i};
+        }
+    }
+    std::sort(sorted.begin(), sorted.begin() + n);
+
+    CanonicalCode::Lengths lengths{};
+    if (n == 0) {
+        return lengths;
+    }
+    if (n == 1) {
+        lengths[sorted[0].second] = 1;
+        return lengths;
+    }
+
+    std::array<FrequencyType, CanonicalCode::ALPHABET_SIZE> weight;
+    for (size_t i = 0; i < n; ++i) {
+        weight[i] = sorted[i].first;
+    }
+
+    // left to right: internal node `next` is the sum of the two smallest of the leaves and the earlier nodes,
+    // nodes that got merged keep the index of their parent
+    weight[0] += weight[1];
+    size_t root = 0;
+    size_t leaf = 2;
+    for (size_t next = 1; next < n - 1; ++next) {
+        if (leaf >= n || weight[root] < weight[leaf]) {
+            weight[next] = weight[root];
+            weight[root++] = next;
+        } else {
+            weight[next] = weight[leaf++];
+        }
+        if (leaf >= n || (root < next && weight[root] < weight[leaf])) {
+            weight[next] += weight[root];
+            weight[root++] = next;
+        } else {
+            weight[next] += weight[leaf++];
+        }
+    }
+
+    // right to left: depths of the internal nodes
+    weight[n - 2] = 0;
+    for (size_t next = n - 2; next-- > 0;) {
+        weight[next] = weight[weight[next]] + 1;
+    }
+
+    // right to left: depths of the leaves, from the number of internal nodes on each level
+    size_t available = 1;
+    size_t used = 0;
+    size_t depth = 0;
+    auto internal = static_cast<ptrdiff_t>(n) - 2;
+    auto next = static_cast<ptrdiff_t>(n) - 1;
+    while (available > 0) {
+        while (internal >= 0 && weight[internal] == depth) {
+            ++used;
+            --internal;
+        }
+        while (available > used) {
+            weight[next--] = depth;
+            --available;
+        }
+        available = 2 * used;
+        ++depth;
+        used = 0;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        lengths[sorted[i].second] = weight[i];
+    }
+    return lengths;
+}
+
+CanonicalCode::Lengths CodeLengths::Limited(const Frequencies& frequencies, size_t max_length) {
+    // L. Larmore, D. Hirschberg, "A Fast Algorithm for Optimal Length-Limited Huffman Codes", 1990.
+    // List `level` merges the leaves with pairs of items of list `level + 1`. The first 2n - 2 items of list 0
+    // are the cheapest set of "coins", and a leaf's code length is the number of lists it is taken from.
+    // Taken leaves always form a prefix of the sorted ones, so only the number of them is tracked
+    std::array<std::pair<FrequencyType, size_t>, CanonicalCode::ALPHABET_SIZE> sorted;
+    size_t n = 0;
+    for (size_t i = 0; i < frequencies.size(); ++i) {
+        if (frequencies[i] != 0) {
+            sorted[n++] = {frequencies[i], i};
+        }
+    }
+    std::sort(sorted.begin(), sorted.begin() + n);
+
+    CanonicalCode::Lengths lengths{};
+    if (n <= 1) {
+        if (n == 1) {
+            lengths[sorted[0].second] = 1;
+        }
+        return lengths;
+    }
+    if (max_length < 64 && (size_t(1) << max_length) < n) {
+        throw std::invalid_argument(std::to_string(n) + " symbols do not fit into codes of " +
+                                    std::to_string(max_length) + " bits");
+    }
+
+    struct Item {
+        FrequencyType weight;
+        bool is_package;
+    };
+    std::vector<std::vector<Item>> lists(max_length);
+    for (size_t level = max_length; level-- > 0;) {
+        auto& list = lists[level];
+        list.reserve(2 * n);
+        const std::vector<Item>* next = level + 1 < max_length ? &lists[level + 1] : nullptr;
+        size_t packages = next != nullptr ? next->size() / 2 : 0;
+
+        size_t leaf = 0;
+        size_t package = 0;
+        while (leaf < n || package < packages) {
+            FrequencyType package_weight = 0;
+            if (package < packages) {
+                package_weight = (*next)[2 * package].weight + (*next)[2 * package + 1].weight;
+            }
+            if (package == packages || (leaf < n && sorted[leaf].first <= package_weight)) {
+                list.push_back({sorted[leaf++].first, false});
+            } else {
+                list.push_back({package_weight, true});
+                ++package;
+            }
+        }
+    }
+
+    size_t taken = 2 * n - 2;
+    for (size_t level = 0; level < max_length && taken != 0; ++level) {
+        size_t packages = 0;
+        for (size_t i = 0; i < taken; ++i) {
+            if (lists[level][i].is_package) {
+                ++packages;
+            } else {
+                ++lengths[sorted[i - packages].second];
+            }
+        }
+        taken = 2 * packages;
+    }
+    return lengths;
+}
+
+uint64_t CodeLengths::CodedSize(const Frequencies& frequencies, const CanonicalCode::Lengths& lengths) {
+    uint64_t size = 0;
+    for (size_t i = 0; i < frequencies.size(); ++i) {
+        size += frequencies[i] * lengths[i];
+    }
+    return size;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "canonical_code.h"
+
+// Huffman code lengths for symbol frequencies. Symbols with frequency 0 get no code (length 0)
+class CodeLengths {
+public:
+    using FrequencyType = uint64_t;
+    using Frequencies = std::array<FrequencyType, CanonicalCode::ALPHABET_SIZE>;
+
+    enum class Builder {
+        TRIE,      // merges Trie nodes in a MinHeap, then walks the tree
+        IN_PLACE,  // sorts the frequencies, then Moffat-Katajainen in place: linear time, no allocations
+    };
+
+    // Any limit fits all CanonicalCode::ALPHABET_SIZE symbols from this one on
+    static constexpr size_t MIN_LENGTH_LIMIT = 9;
+
+    static CanonicalCode::Lengths Build(const Frequencies& frequencies, Builder builder);
+    static CanonicalCode::Lengths FromTrie(const Frequencies& frequencies);
+    static CanonicalCode::Lengths InPlace(const Frequencies& frequencies);
+    // Optimal lengths of at most `max_length`, by package-merge. Takes O(symbols * max_length) time and memory.
+    // Throws std::invalid_argument if the symbols do not fit into codes of `max_length` bits
+    static CanonicalCode::Lengths Limited(const Frequencies& frequencies, size_t max_length);
+
+    // Total length of the coded symbols in bits
+    static uint64_t CodedSize(const Frequencies& frequencies, const CanonicalCode::Lengths& lengths);
+};
@@ -1,106 +1,39 @@
 #include "decoder.h"
 
+#include <algorithm>
+#include <exception>
 #include <fstream>
-#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 
-#include "trie.h"
-
-#include <iostream>
+#include "spsc_ring.h"
 
 using Int = BitReader::ResultType;
-using TriePtr = RawTrie<Int>::TriePtr;
-
-namespace {
-
-void AddCode(Trie<Int>& target, Int key, const std::vector<bool>& code) {
-    auto current = target.GetRaw();
-    if (current == nullptr) {
-        current.reset(new RawTrie<Int>());
-    }
-    for (auto e : code) {
-        auto next = (e == 0 ? current->GetLeft() : current->GetRight());
-        if (next == nullptr) {
-            if (e == 0) {
-                current->SetLeft(std::make_shared<RawTrie<Int>>());
-                next = current->GetLeft();
-            }
-            else {
-                current->SetRight(std::make_shared<RawTrie<Int>>());
-                next = current->GetRight();
-            }
-        }
-        current = next;
-    }
-    current->SetValue(key);
-}
-
-uint32_t GetChar(Trie<Int>& target, Decoder& decoder, std::function<uint32_t(Decoder&, size_t)> read) {
-    auto current = target.GetRaw();
-
-    while (!current->IsTerminal()) {
-        uint32_t now = read(decoder, 1);
-        assert(current != nullptr);
-        auto next = (now == 0 ? current->GetLeft() : current->GetRight());
-        current = next;
-    }
-    return current->GetValue();
-}
-
-}  // namespace
 
 Decoder::IncorrectFile::IncorrectFile(const char* message) : std::runtime_error(message) {
 }
 
-Decoder::Decoder(BitReader&& archive, const std::string& output_directory_path)
-    : archive_(archive), path_(output_directory_path) {
+Decoder::Decoder(BitReader&& archive, const std::string& output_directory_path, size_t pipeline_depth)
+    : archive_(std::move(archive)), path_(output_directory_path), pipeline_depth_(pipeline_depth) {
 }
 
 void Decoder::Decode() {
-    using Code = std::pair<uint32_t, std::vector<bool>>;
-
     while (true) {
         size_t character_count = ReadSome(9);
-        std::vector<Int> characters(character_count);
-
-        for (auto& ch : characters) {
-            ch = ReadSome(9);
-        }
-
-        std::vector<Int> lengths;
-        Int total_length = 0;
-        while (total_length < character_count) {
-            Int current = ReadSome(9);
-            lengths.push_back(current);
-            total_length += current;
-        }
-
-        std::vector<Code> codes;
-        codes.reserve(character_count);
-        std::vector<bool> current_code(1, false);
-
-        size_t length_pointer = 0;
-        for (size_t i = 0; i < character_count; ++i) {
-            while (lengths[length_pointer] == 0) {
-                current_code.push_back(false);
-                ++length_pointer;
-            }
-            --lengths[length_pointer];
-            codes.push_back({characters[i], current_code});
-            size_t k = current_code.size() - 1;
-            while (true) {
-                current_code[k] = !current_code[k];
-                if (current_code[k] == 1 || k == 0) {
-                    break;
-                }
-                --k;
+        if (character_count == STORED_ENTRY) {
+            if (DecodeStored()) {
+                break;
             }
+            continue;
         }
-
-        Trie<Int> trie_codes;
-        for (const auto& [key, code] : codes) {
-            AddCode(trie_codes, key, code);
+        if (character_count == BLOCKED_ENTRY) {
+            if (DecodeBlocked()) {
+                break;
+            }
+            continue;
         }
+        auto code_table = ReadCodeTable(archive_, character_count, CanonicalCode::ALPHABET_SIZE);
 
         bool is_last = false;
         bool file_name_ended = false;
@@ -109,7 +42,10 @@ void Decoder::Decode() {
         std::ofstream current_file;
 
         while (true) {
-            auto char_code = GetChar(trie_codes, *this, std::mem_fn(&Decoder::ReadSome));
+            auto char_code = code_table.Decode(archive_);
+            if (char_code == CanonicalCode::NO_SYMBOL) {
+                throw IncorrectFile("Invalid file. Expected archive-format file");
+            }
             if (char_code == ARCHIVE_END) {
                 is_last = true;
                 break;
@@ -137,8 +73,233 @@ void Decoder::Decode() {
     }
 }
 
+Decoder::Statistics Decoder::GetStatistics() const {
+    return {.input_reads = archive_.IoCalls()};
+}
+
+bool Decoder::DecodeStored() {
+    archive_.Align();
+    std::string file_name(ReadSome(STORED_NAME_SIZE_BITS), '\0');
+    uint64_t size = ReadSome(32);
+    size = (size << 32) | ReadSome(32);
+    if (archive_.ReadBytes(file_name) != file_name.size()) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+
+    std::ofstream current_file(path_ + file_name, std::ios_base::binary);
+    std::vector<BitStream::CharType> block(1 << 16);
+    while (size != 0) {
+        auto count = archive_.ReadBytes(std::span(block.data(), std::min<uint64_t>(size, block.size())));
+        if (count == 0) {
+            throw IncorrectFile("Invalid file. Expected archive-format file");
+        }
+        current_file.write(block.data(), static_cast<std::streamsize>(count));
+        size -= count;
+    }
+    return ReadEnd();
+}
+
+bool Decoder::DecodeBlocked() {
+    archive_.Align();
+    std::ofstream current_file(path_ + ReadName(), std::ios_base::binary);
+    if (pipeline_depth_ != 0) {
+        DecodeBlocksPipelined(current_file);
+    } else {
+        DecodeBlocks(current_file);
+    }
+    return ReadEnd();
+}
+
+void Decoder::DecodeBlocks(std::ostream& output) {
+    std::vector<BitStream::CharType> block;
+    while (true) {
+        auto [size, payload_bits] = ReadBlockHeader();
+        if (size == 0) {
+            break;
+        }
+        block.resize(size);
+        DecodeBlock(archive_, payload_bits, block);
+        output.write(block.data(), static_cast<std::streamsize>(block.size()));
+    }
+}
+
+void Decoder::DecodeBlocksPipelined(std::ostream& output) {
+    using Buffer = std::vector<BitStream::CharType>;
+    struct Payload {
+        Buffer bytes;
+        size_t size = 0;
+        size_t payload_bits = 0;
+    };
+    SpscRing<Payload> read(pipeline_depth_);
+    SpscRing<Buffer> decoded(pipeline_depth_);
+    // Emptied buffers back to the stage that fills them
+    SpscRing<Buffer> free_payloads(pipeline_depth_ + 2);
+    SpscRing<Buffer> free_blocks(pipeline_depth_ + 2);
+
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto fail = [&] {
+        std::lock_guard lock(mutex);
+        if (error == nullptr) {
+            error = std::current_exception();
+        }
+    };
+
+    // Stages stop as described on SpscRing
+    std::thread decoder([&] {
+        try {
+            Payload payload;
+            size_t allocated = 0;
+            while (read.Pop(payload)) {
+                Buffer block;
+                if (allocated < free_blocks.Capacity()) {
+                    ++allocated;
+                } else if (!free_blocks.Pop(block)) {
+                    break;
+                }
+                block.resize(payload.size);
+                BitReader input(std::make_unique<MemorySource>(payload.bytes));
+                DecodeBlock(input, payload.payload_bits, block);
+                free_payloads.Push(payload.bytes);
+                if (!decoded.Push(block)) {
+                    break;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+        read.Cancel();
+        free_blocks.Cancel();
+        decoded.Close();
+        free_payloads.Close();
+    });
+    std::thread writer([&] {
+        try {
+            Buffer block;
+            while (decoded.Pop(block)) {
+                output.write(block.data(), static_cast<std::streamsize>(block.size()));
+                free_blocks.Push(block);
+            }
+        } catch (...) {
+            fail();
+        }
+        decoded.Cancel();
+        free_blocks.Close();
+    });
+
+    try {
+        size_t allocated = 0;
+        while (true) {
+            auto [size, payload_bits] = ReadBlockHeader();
+            if (size == 0) {
+                break;
+            }
+            Payload payload{.bytes = {}, .size = size, .payload_bits = payload_bits};
+            if (allocated < free_payloads.Capacity()) {
+                ++allocated;
+            } else if (!free_payloads.Pop(payload.bytes)) {
+                break;
+            }
+            payload.bytes.resize((payload_bits + BitStream::CHAR_SIZE - 1) / BitStream::CHAR_SIZE);
+            if (archive_.ReadBytes(payload.bytes) != payload.bytes.size()) {
+                throw IncorrectFile("Invalid file. Expected archive-format file");
+            }
+            if (!read.Push(payload)) {
+                break;
+            }
+        }
+    } catch (...) {
+        fail();
+    }
+    free_payloads.Cancel();
+    read.Close();
+    decoder.join();
+    writer.join();
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+}
+
+std::pair<size_t, size_t> Decoder::ReadBlockHeader() {
+    size_t size = ReadSome(BLOCK_SIZE_BITS);
+    if (size == 0) {
+        return {0, 0};
+    }
+    size_t payload_bits = ReadSome(BLOCK_SIZE_BITS);
+    // a payload is never larger than the block stored
+    if (size > MAX_BLOCK_SIZE || payload_bits > 2 * BitStream::CHAR_SIZE + BitStream::CHAR_SIZE * size) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+    return {size, payload_bits};
+}
+
+void Decoder::DecodeBlock(BitReader& input, size_t payload_bits, std::span<BitStream::CharType> block) const {
+    auto start = input.Tell();
+    size_t symbol_count = ReadSome(input, 9);
+    if (symbol_count == STORED_ENTRY) {
+        input.Align();
+        if (input.ReadBytes(block) != block.size()) {
+            throw IncorrectFile("Invalid file. Expected archive-format file");
+        }
+    } else {
+        auto code_table = ReadCodeTable(input, symbol_count, FILENAME_END);
+        for (auto& byte : block) {
+            auto symbol = code_table.Decode(input);
+            if (symbol >= FILENAME_END) {
+                throw IncorrectFile("Invalid file. Expected archive-format file");
+            }
+            byte = static_cast<BitStream::CharType>(symbol);
+        }
+    }
+    input.Align();
+    auto padded_bits = (payload_bits + BitStream::CHAR_SIZE - 1) / BitStream::CHAR_SIZE * BitStream::CHAR_SIZE;
+    if (input.Tell() - start != padded_bits) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+}
+
+CanonicalCode Decoder::ReadCodeTable(BitReader& input, size_t symbol_count, Int alphabet_size) {
+    std::vector<Int> characters(symbol_count);
+    for (auto& ch : characters) {
+        ch = ReadSome(input, 9);
+    }
+
+    std::vector<size_t> length_counts;
+    Int total_length = 0;
+    while (total_length < symbol_count) {
+        Int current = ReadSome(input, 9);
+        length_counts.push_back(current);
+        total_length += current;
+    }
+    auto is_symbol = [alphabet_size](Int ch) { return ch < alphabet_size; };
+    if (total_length != symbol_count || !std::all_of(characters.begin(), characters.end(), is_symbol)) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+    return CanonicalCode(std::move(characters), std::move(length_counts));
+}
+
+std::string Decoder::ReadName() {
+    std::string file_name(ReadSome(STORED_NAME_SIZE_BITS), '\0');
+    if (archive_.ReadBytes(file_name) != file_name.size()) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+    return file_name;
+}
+
+bool Decoder::ReadEnd() {
+    auto end = ReadSome(9);
+    if (end != ONE_MORE_FILE && end != ARCHIVE_END) {
+        throw IncorrectFile("Invalid file. Expected archive-format file");
+    }
+    return end == ARCHIVE_END;
+}
+
 BitReader::ResultType Decoder::ReadSome(size_t to_read = 1) {
-    auto [value, result] = archive_.ReadSome(to_read);
+    return ReadSome(archive_, to_read);
+}
+
+BitReader::ResultType Decoder::ReadSome(BitReader& input, size_t to_read) {
+    auto [value, result] = input.ReadSome(to_read);
     if (!result) {
         throw IncorrectFile("Invalid file. Expected archive-format file");
     }
@@ -1,27 +1,65 @@
 #pragma once
 
+#include <ostream>
+#include <span>
 #include <stdexcept>
+#include <utility>
 
 #include "bit_reader.h"
+#include "canonical_code.h"
 
 class Decoder {
 public:
     const uint32_t FILENAME_END = 256;
     const uint32_t ONE_MORE_FILE = 257;
     const uint32_t ARCHIVE_END = 258;
+    // See Encoder::STORED_ENTRY
+    static constexpr uint32_t STORED_ENTRY = 511;
+    static constexpr size_t STORED_NAME_SIZE_BITS = 16;
+    // See Encoder::BLOCKED_ENTRY
+    static constexpr uint32_t BLOCKED_ENTRY = 510;
+    static constexpr size_t BLOCK_SIZE_BITS = 32;
+    static constexpr size_t MAX_BLOCK_SIZE = size_t(1) << 28;
 
     class IncorrectFile : public std::runtime_error {
     public:
         explicit IncorrectFile(const char* message);
     };
 
-    explicit Decoder(BitReader&& archive, const std::string& output_directory_path);
+    struct Statistics {
+        size_t input_reads = 0;
+    };
+
+    // With `pipeline_depth` not 0, blocked entries are read, decoded and written in stages on threads of their own,
+    // joined by SpscRing queues of that many blocks
+    explicit Decoder(BitReader&& archive, const std::string& output_directory_path, size_t pipeline_depth = 0);
 
     void Decode();
 
+    Statistics GetStatistics() const;
+
 private:
     BitReader::ResultType ReadSome(size_t to_read);
+    static BitReader::ResultType ReadSome(BitReader& input, size_t to_read);
+    // Copies a stored entry out. Returns whether it was the last one
+    bool DecodeStored();
+    // Same for a blocked entry
+    bool DecodeBlocked();
+    // Blocks of a blocked entry, up to the terminator, into `output`
+    void DecodeBlocks(std::ostream& output);
+    void DecodeBlocksPipelined(std::ostream& output);
+    // Size and payload size of the next block, {0, 0} at the terminator
+    std::pair<size_t, size_t> ReadBlockHeader();
+    // Payload of `payload_bits` bits from `input`, byte-aligned, into `block`
+    void DecodeBlock(BitReader& input, size_t payload_bits, std::span<BitStream::CharType> block) const;
+    // Table of `symbol_count` symbols, each less than `alphabet_size`
+    static CanonicalCode ReadCodeTable(BitReader& input, size_t symbol_count, BitReader::ResultType alphabet_size);
+    // Name size and name of a blocked entry
+    std::string ReadName();
+    // Reads the end marker of a stored or blocked entry. Returns whether it was the last one
+    bool ReadEnd();
 
     BitReader archive_;
     std::string path_;
+    size_t pipeline_depth_;
 };
@@ -1,21 +1,712 @@
 #include "encoder.h"
 
 #include <algorithm>
-#include <tuple>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <utility>
 
-#include "heap.h"
-#include "trie.h"
+#include "histogram.h"
+#include "spsc_ring.h"
+#include "task_pool.h"
 
-Encoder::Encoder(Encoder::OutputStream&& archive) : archive_(archive) {
+namespace {
+
+// Packs the codes of `N` bytes into one BitWriter::Append. Their lengths must add up to at most MAX_APPEND_REQUEST
+template <size_t N>
+size_t OutputPacked(BitWriter& output, const CanonicalCode& code_table, std::span<const BitStream::CharType> block) {
+    size_t i = 0;
+    for (; i + N <= block.size(); i += N) {
+        BitWriter::AccumulatorType bits = 0;
+        BitStream::Size size = 0;
+        for (size_t j = 0; j < N; ++j) {
+            const auto& code = code_table[static_cast<uint8_t>(block[i + j])];
+            bits = (bits << code.length) | code.code;
+            size += code.length;
+        }
+        output.Append(bits, size);
+    }
+    return i;
+}
+
+// Deleted once it is closed
+std::unique_ptr<FILE, decltype(&std::fclose)> TemporaryFile() {
+    std::unique_ptr<FILE, decltype(&std::fclose)> file(std::tmpfile(), &std::fclose);
+    if (file == nullptr) {
+        throw std::system_error(errno, std::generic_category(), "can't create a temporary file");
+    }
+    return file;
+}
+
+// Copy of what the frequency pass reads, for the encoding pass to read instead of the input
+class InputCopy {
+public:
+    InputCopy(BitReader& input, size_t memory_limit) : input_(input), memory_limit_(memory_limit) {
+        if (input.InMemory() || (input.CanRestore() && input.SizeHint() > memory_limit)) {
+            state_ = State::READ_AGAIN;
+        } else if (memory_limit != 0 || !input.CanRestore()) {
+            state_ = State::MEMORY;
+        }
+    }
+
+    void Add(std::span<const BitStream::CharType> block) {
+        if (state_ == State::MEMORY && memory_.size() + block.size() > memory_limit_) {
+            if (input_.CanRestore()) {
+                state_ = State::READ_AGAIN;
+                std::vector<BitStream::CharType>().swap(memory_);
+            } else {
+                Spill();
+            }
+        }
+        if (state_ == State::MEMORY) {
+            memory_.insert(memory_.end(), block.begin(), block.end());
+        } else if (state_ == State::SPILL) {
+            spill_sink_->Write(block.data(), block.size());
+            spilled_ += block.size();
+        }
+    }
+
+    // Whether Add needs the blocks of the frequency pass, in order
+    bool NeedsBlocks() const {
+        return state_ != State::READ_AGAIN;
+    }
+
+    // Reader for the encoding pass, at the beginning of the input
+    BitReader& Replay() {
+        if (state_ == State::MEMORY) {
+            return replay_.emplace(std::make_unique<MemorySource>(memory_));
+        }
+        if (state_ == State::SPILL) {
+            auto source = std::make_unique<FdSource>(fileno(spill_.get()));
+            source->Rewind();
+            return replay_.emplace(std::move(source));
+        }
+        input_.Restore();
+        return input_;
+    }
+
+    size_t SpilledBytes() const {
+        return spilled_;
+    }
+
+private:
+    enum class State { READ_AGAIN, MEMORY, SPILL };
+
+    void Spill() {
+        spill_ = TemporaryFile();
+        spill_sink_ = std::make_unique<FdSink>(fileno(spill_.get()));
+        spill_sink_->Write(memory_.data(), memory_.size());
+        spilled_ = memory_.size();
+        std::vector<BitStream::CharType>().swap(memory_);
+        state_ = State::SPILL;
+    }
+
+    BitReader& input_;
+    size_t memory_limit_;
+    State state_ = State::READ_AGAIN;
+
+    std::vector<BitStream::CharType> memory_;
+    std::unique_ptr<FILE, decltype(&std::fclose)> spill_{nullptr, &std::fclose};
+    std::unique_ptr<FdSink> spill_sink_;
+    size_t spilled_ = 0;
+    std::optional<BitReader> replay_;
+};
+
+// Bytes of an entry encoded ahead of its turn: in `memory` up to Encoder::PART_MEMORY_SIZE, then all of them in
+// `spill`. Adds the bytes written to `spill` to `spilled`
+class PartSink : public ByteSink {
+public:
+    PartSink(std::vector<CharType>& memory, std::unique_ptr<FILE, decltype(&std::fclose)>& spill, size_t& spilled)
+        : memory_(memory), spill_(spill), spilled_(spilled) {
+    }
+
+    void Write(const CharType* data, Size size) override {
+        if (spill_sink_ == nullptr && memory_.size() + size > Encoder::PART_MEMORY_SIZE) {
+            spill_ = TemporaryFile();
+            spill_sink_ = std::make_unique<FdSink>(fileno(spill_.get()));
+            spill_sink_->Write(memory_.data(), memory_.size());
+            spilled_ += memory_.size();
+            std::vector<CharType>().swap(memory_);
+        }
+        if (spill_sink_ != nullptr) {
+            spill_sink_->Write(data, size);
+            spilled_ += size;
+        } else {
+            memory_.insert(memory_.end(), data, data + size);
+        }
+    }
+
+private:
+    std::vector<CharType>& memory_;
+    std::unique_ptr<FILE, decltype(&std::fclose)>& spill_;
+    size_t& spilled_;
+    std::unique_ptr<FdSink> spill_sink_;
+};
+
+// Fills `target` from an entry that EncodeFiles encoded ahead of its turn, which has all the bytes asked for
+std::span<BitStream::CharType> ReadPartBytes(BitReader& part, std::span<BitStream::CharType> target) {
+    if (part.ReadBytes(target) != target.size()) {
+        throw std::runtime_error("can't read back an encoded entry");
+    }
+    return target;
+}
+
+// `options` for one of several files encoded at once, each on a single thread
+Encoder::Options OnOneThread(Encoder::Options options) {
+    options.block_threads = 1;
+    options.histogram_threads = 1;
+    options.pipeline_depth = 0;
+    return options;
+}
+
+// Byte counts of `size` bytes of `input` and of whatever follows them, in case the file grew. `threads` ranges are
+// counted at once, each into its own Histogram, but no more ranges than there are blocks. Adds the reads issued to
+// `reads`
+Histogram::Counts CountInParallel(const BitReader& input, size_t size, size_t threads, size_t& reads) {
+    const auto block_size = Encoder::READ_BLOCK_SIZE;
+    threads = std::clamp<size_t>((size + block_size - 1) / block_size, 1, threads);
+    auto range = (size / threads + block_size - 1) / block_size * block_size;
+    std::vector<Histogram::Counts> counts(threads);
+    std::vector<size_t> range_reads(threads);
+    std::vector<std::exception_ptr> errors(threads);
+
+    auto count = [&](size_t index) {
+        try {
+            std::vector<BitStream::CharType> block(block_size);
+            Histogram histogram;
+            auto offset = index * range;
+            auto end = (index + 1 == threads) ? std::numeric_limits<size_t>::max() : std::min(size, offset + range);
+            while (offset < end) {
+                auto read = input.ReadAt(offset, std::span(block.data(), std::min(block_size, end - offset)));
+                ++range_reads[index];
+                if (read == 0) {
+                    break;
+                }
+                histogram.Add(std::span(block.data(), read));
+                offset += read;
+            }
+            counts[index] = histogram.GetCounts();
+        } catch (...) {
+            errors[index] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(count, i);
+    }
+    count(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (const auto& error : errors) {
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    Histogram::Counts total{};
+    for (size_t i = 0; i < threads; ++i) {
+        for (size_t symbol = 0; symbol < Histogram::SYMBOLS; ++symbol) {
+            total[symbol] += counts[i][symbol];
+        }
+        reads += range_reads[i];
+    }
+    return total;
+}
+
+}  // namespace
+
+Encoder::Encoder(Encoder::OutputStream&& archive) : archive_(std::move(archive)) {
+}
+Encoder::Encoder(Encoder::OutputStream&& archive, const Encoder::Options& options)
+    : archive_(std::move(archive)), options_(options) {
 }
 
 void Encoder::EncodeFile(Encoder::InputStream&& file, bool is_last) {
-    using QueueKey = std::pair<FrequencyType, Trie<size_t>>;
+    EncodeEntry(file, is_last);
+    if (is_last) {
+        archive_.output.Flush();
+    }
+}
+
+void Encoder::EncodeFiles(size_t count, const Encoder::FileOpener& open, size_t threads,
+                          const Encoder::FileSizer& size_of) {
+    if (threads <= 1 || count <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            EncodeFile(open(i), i + 1 == count);
+        }
+        return;
+    }
+
+    // A file encoded as a whole, into `part` or straight into the archive, or, when it is coded in blocks and can be
+    // read at any offset, block by block into `blocks`. Started by a worker or in turn by the appender, whichever
+    // comes first
+    struct Job {
+        bool started = false;
+        bool ready = false;
+        std::optional<Part> part;
+        std::shared_ptr<InputStream> file;
+        size_t size = 0;
+        std::vector<std::optional<EncodedBlock>> blocks;
+        size_t sample_reads = 0;
+    };
+    std::vector<Job> jobs(count);
+    // Read buffers of block tasks, reused
+    std::vector<std::vector<BitStream::CharType>> free_buffers;
+    std::mutex mutex;
+    std::condition_variable job_done;
+    std::exception_ptr error;
+    TaskPool pool(threads);
+
+    auto fail = [&] {
+        std::lock_guard lock(mutex);
+        if (error == nullptr) {
+            error = std::current_exception();
+        }
+        job_done.notify_all();
+    };
+    auto cancelled = [&] {
+        std::lock_guard lock(mutex);
+        return error != nullptr;
+    };
 
-    const size_t alphabet_size = 259;
+    auto encode_block = [&](const std::shared_ptr<InputStream>& file, size_t index, size_t block, size_t size) {
+        if (cancelled()) {
+            return;
+        }
+        try {
+            auto offset = block * options_.block_size;
+            std::vector<BitStream::CharType> data;
+            {
+                std::lock_guard lock(mutex);
+                if (!free_buffers.empty()) {
+                    data = std::move(free_buffers.back());
+                    free_buffers.pop_back();
+                }
+            }
+            data.resize(std::min(options_.block_size, size - offset));
+            size_t read = 0;
+            size_t reads = 0;
+            while (read < data.size()) {
+                auto current = file->input.ReadAt(offset + read, std::span(data).subspan(read));
+                ++reads;
+                if (current == 0) {
+                    throw std::runtime_error("input changed while it was read: " + file->name);
+                }
+                read += current;
+            }
+            if (offset + data.size() == size) {
+                // the file has to end where its size said it would
+                BitStream::CharType next = 0;
+                ++reads;
+                if (file->input.ReadAt(size, std::span(&next, 1)) != 0) {
+                    throw std::runtime_error("input changed while it was read: " + file->name);
+                }
+            }
+            auto encoded = EncodeBlock(data, options_);
+            encoded.statistics.input_reads += reads;
+
+            std::lock_guard lock(mutex);
+            free_buffers.push_back(std::move(data));
+            jobs[index].blocks[block] = std::move(encoded);
+            job_done.notify_all();
+        } catch (...) {
+            fail();
+        }
+    };
+    auto start = [&](size_t index) {
+        std::lock_guard lock(mutex);
+        return !std::exchange(jobs[index].started, true);
+    };
+    auto encode_file = [&](size_t index, bool in_turn) {
+        if (cancelled()) {
+            return;
+        }
+        try {
+            auto file = std::make_shared<InputStream>(open(index));
+            auto size = file->input.SizeHint();
+            std::optional<Model> model;
+            if (options_.block_size != 0 && size > options_.block_size && file->input.CanReadAt()) {
+                model = Classify(*file, options_);
+            }
+            if (model.has_value() && model->blocked) {
+                // the appender submits the blocks
+                std::lock_guard lock(mutex);
+                auto& job = jobs[index];
+                job.blocks.resize((size + options_.block_size - 1) / options_.block_size);
+                job.sample_reads = file->input.IoCalls();
+                job.size = size;
+                job.file = std::move(file);
+                job.ready = true;
+                job_done.notify_all();
+                return;
+            }
+
+            if (in_turn) {
+                EncodeInTurn(std::move(*file), index + 1 == count, model.has_value() ? &*model : nullptr);
+                std::lock_guard lock(mutex);
+                jobs[index].ready = true;
+                return;
+            }
+            auto part = EncodePart(std::move(*file), index + 1 == count, model.has_value() ? &*model : nullptr);
+            std::lock_guard lock(mutex);
+            jobs[index].part = std::move(part);
+            jobs[index].ready = true;
+            job_done.notify_all();
+        } catch (...) {
+            fail();
+        }
+    };
+
+    // Files are taken in order, within `window` files of the one to be appended next. The largest of the files taken
+    // at once go first
+    const size_t window = 2 * threads;
+    size_t admitted = 0;
+    auto admit = [&](size_t until) {
+        std::vector<size_t> files;
+        for (; admitted < std::min(until, count); ++admitted) {
+            files.push_back(admitted);
+        }
+        if (size_of) {
+            // a worker takes the file it got last first
+            std::stable_sort(files.begin(), files.end(), [&](size_t l, size_t r) { return size_of(l) < size_of(r); });
+        }
+        for (auto index : files) {
+            pool.Submit([&start, &encode_file, index] {
+                if (start(index)) {
+                    encode_file(index, false);
+                }
+            });
+        }
+    };
+    // Blocks are submitted in the order they are appended, up to `window` of them encoded or being encoded and not
+    // appended yet. The next block to append is always among them, idle workers steal the oldest
+    size_t blocks_held = 0;
+    size_t next_job = 0;
+    size_t next_block = 0;
+    auto submit_blocks = [&] {
+        while (blocks_held < window && next_job < admitted && jobs[next_job].ready) {
+            auto& job = jobs[next_job];
+            if (next_block == job.blocks.size()) {
+                ++next_job;
+                next_block = 0;
+                continue;
+            }
+            pool.Submit([&encode_block, file = job.file, index = next_job, block = next_block, size = job.size] {
+                encode_block(file, index, block, size);
+            });
+            ++blocks_held;
+            ++next_block;
+        }
+    };
+    // Waits under `lock` until `ready` or an error, returning false on an error. Submits blocks as jobs get ready
+    auto wait_for = [&](std::unique_lock<std::mutex>& lock, const std::function<bool()>& ready) {
+        while (true) {
+            submit_blocks();
+            if (error != nullptr || ready()) {
+                return error == nullptr;
+            }
+            job_done.wait(lock);
+        }
+    };
+
+    try {
+        admit(window);
+        for (size_t i = 0; i < count; ++i) {
+            bool is_last = i + 1 == count;
+            if (start(i)) {
+                encode_file(i, true);
+            }
+            std::unique_lock lock(mutex);
+            auto& job = jobs[i];
+            if (!wait_for(lock, [&] { return job.ready; })) {
+                break;
+            }
+
+            if (job.part.has_value()) {
+                auto part = std::move(*job.part);
+                job.part.reset();
+                lock.unlock();
+                Stitch(part);
+            } else if (job.file != nullptr) {
+                auto file = job.file;
+                lock.unlock();
+                OutputBlockedStart(file->name);
+                statistics_.input_reads += job.sample_reads;
+                for (auto& slot : job.blocks) {
+                    lock.lock();
+                    if (!wait_for(lock, [&] { return slot.has_value(); })) {
+                        break;
+                    }
+                    auto block = std::move(*slot);
+                    slot.reset();
+                    --blocks_held;
+                    lock.unlock();
+                    OutputBlock(block);
+                }
+                if (lock.owns_lock()) {
+                    break;
+                }
+                OutputBlockedEnd(is_last);
+                lock.lock();
+                job.file.reset();
+                lock.unlock();
+            } else {
+                // encoded in turn, it is in the archive already
+                lock.unlock();
+            }
+            if (is_last) {
+                archive_.output.Flush();
+            }
+            admit(i + 1 + window);
+        }
+    } catch (...) {
+        fail();
+    }
+    pool.Wait();
+
+    auto elapsed = std::chrono::duration<double>(pool.Elapsed()).count();
+    for (const auto& worker : pool.GetStatistics()) {
+        auto busy = std::chrono::duration<double>(worker.busy).count();
+        statistics_.workers.push_back(
+            {.tasks = worker.tasks, .stolen = worker.stolen, .utilization = elapsed > 0 ? busy / elapsed : 0});
+    }
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Encoder::EncodeEntry(Encoder::InputStream& file, bool is_last, Encoder::Part* part,
+                          const Encoder::Model* classified) {
+    decision_.reset();
+    InputCopy input_copy(file.input, options_.single_read_limit);
+    BlockCallback copy_block;
+    if (input_copy.NeedsBlocks()) {
+        copy_block = [&input_copy](auto block) { input_copy.Add(block); };
+    }
+    auto model = BuildModel(file, options_, copy_block, classified);
+    if (model.stored_on_estimate) {
+        OutputStored(file.name, file.input, model.data_size);
+        archive_.output.WriteSome(is_last ? ARCHIVE_END : ONE_MORE_FILE, 9);
+        ++statistics_.stored_files;
+        ++statistics_.sampled_stored_files;
+    } else if (model.blocked) {
+        EncodeBlocked(file.name, file.input, is_last);
+    } else {
+        EncodeScanned(file.name, is_last, model, input_copy.Replay(), part);
+        statistics_.spilled_bytes += input_copy.SpilledBytes();
+    }
+    statistics_.input_reads += file.input.IoCalls() + model.range_reads;
+}
+
+void Encoder::EncodeInTurn(Encoder::InputStream&& file, bool is_last, const Encoder::Model* classified) {
+    Encoder encoder(std::move(archive_), OnOneThread(options_));
+    try {
+        encoder.EncodeEntry(file, is_last, nullptr, classified);
+    } catch (...) {
+        archive_ = std::move(encoder.archive_);
+        throw;
+    }
+    archive_ = std::move(encoder.archive_);
+    AddStatistics(statistics_, encoder.statistics_);
+}
+
+Encoder::Part Encoder::EncodePart(Encoder::InputStream&& file, bool is_last, const Encoder::Model* classified) const {
+    Part part;
+    size_t spilled = 0;
+    {
+        Encoder encoder({.output = BitWriter(std::make_unique<PartSink>(part.bytes, part.spill, spilled))},
+                        OnOneThread(options_));
+        encoder.EncodeEntry(file, is_last, &part, classified);
+        part.bits = encoder.archive_.output.Tell();
+        encoder.archive_.output.Flush();
+        part.decision = encoder.decision_;
+        part.statistics = encoder.statistics_;
+    }
+    part.statistics.spilled_bytes += spilled;
+    if (part.lengths.has_value()) {
+        // A part is a single entry: only these depend on the form it takes
+        auto statistics = part.statistics;
+        statistics.stored_files = part.coded_statistics.stored_files;
+        statistics.sample_misses = part.coded_statistics.sample_misses;
+        statistics.coded_bits = part.coded_statistics.coded_bits;
+        statistics.optimal_coded_bits = part.coded_statistics.optimal_coded_bits;
+        part.coded_statistics = statistics;
+    }
+    return part;
+}
+
+BitReader Encoder::ReadPart(const Encoder::Part& part) {
+    if (part.spill != nullptr) {
+        auto source = std::make_unique<FdSource>(fileno(part.spill.get()));
+        source->Rewind();
+        return BitReader(std::move(source));
+    }
+    return BitReader(std::make_unique<MemorySource>(part.bytes));
+}
+
+void Encoder::Stitch(const Encoder::Part& part) {
+    auto& output = archive_.output;
+    if (part.decision.has_value()) {
+        const auto& decision = *part.decision;
+        auto stored = StoredEntrySize(output.Tell(), decision.name_size, decision.data_size) < decision.coded_bits;
+        if (stored != decision.stored) {
+            if (!part.lengths.has_value()) {
+                throw std::logic_error("the entry was encoded for another position in the archive");
+            }
+            StitchCoded(part);
+            AddStatistics(statistics_, part.coded_statistics);
+            return;
+        }
+    }
+
+    auto input = ReadPart(part);
+    std::vector<BitStream::CharType> block(READ_BLOCK_SIZE);
+    auto read = [&](size_t size) { return ReadPartBytes(input, std::span(block).first(size)); };
+    // Stored and blocked entries go on from a byte boundary after their first 9 bits, at 2 bytes in the part
+    auto head = read(2);
+    uint32_t kind = (static_cast<uint8_t>(head[0]) << 1) | (static_cast<uint8_t>(head[1]) >> 7);
+    if (kind == STORED_ENTRY || kind == BLOCKED_ENTRY) {
+        output.WriteSome(kind, 9);
+        output.Align();
+    } else {
+        output.WriteBytes(head);
+    }
+    for (auto left = part.bits / BitStream::CHAR_SIZE - head.size(); left != 0;) {
+        auto chunk = read(std::min(left, block.size()));
+        output.WriteBytes(chunk);
+        left -= chunk.size();
+    }
+    if (auto tail = part.bits % BitStream::CHAR_SIZE; tail != 0) {
+        output.WriteSome(static_cast<uint8_t>(read(1)[0]) >> (BitStream::CHAR_SIZE - tail), tail);
+    }
+    AddStatistics(statistics_, part.statistics);
+}
+
+void Encoder::StitchCoded(const Encoder::Part& part) {
+    CanonicalCode code_table(*part.lengths);
+    auto input = ReadPart(part);
+    std::vector<BitStream::CharType> block(READ_BLOCK_SIZE);
+    auto read = [&](size_t size) { return ReadPartBytes(input, std::span(block).first(size)); };
+    // STORED_ENTRY and its padding, then the sizes
+    read(2 + (STORED_NAME_SIZE_BITS + 64) / BitStream::CHAR_SIZE);
+
+    OutputTable(archive_, code_table);
+    for (auto symbol : read(part.decision->name_size)) {
+        Output(archive_, code_table[static_cast<uint8_t>(symbol)]);
+    }
+    Output(archive_, code_table[FILENAME_END]);
+    for (auto left = part.decision->data_size; left != 0;) {
+        auto chunk = read(std::min(left, block.size()));
+        Output(archive_, code_table, chunk);
+        left -= chunk.size();
+    }
+    auto [marker, ok] = input.ReadSome(9);
+    if (!ok) {
+        throw std::runtime_error("can't read back an encoded entry");
+    }
+    Output(archive_, code_table[marker]);
+}
+
+void Encoder::AddStatistics(Encoder::Statistics& total, const Encoder::Statistics& part) {
+    total.input_reads += part.input_reads;
+    total.output_writes += part.output_writes;
+    total.spilled_bytes += part.spilled_bytes;
+    total.coded_bits += part.coded_bits;
+    total.optimal_coded_bits += part.optimal_coded_bits;
+    total.stored_files += part.stored_files;
+    total.sampled_stored_files += part.sampled_stored_files;
+    total.sampled_scanned_files += part.sampled_scanned_files;
+    total.sample_misses += part.sample_misses;
+    total.sample_entropy_error += part.sample_entropy_error;
+    total.coded_blocks += part.coded_blocks;
+    total.stored_blocks += part.stored_blocks;
+}
+
+void Encoder::EncodeScanned(const std::string& name, bool is_last, const Encoder::Model& model, BitReader& input,
+                            Encoder::Part* part) {
+    CanonicalCode code_table(model.lengths);
+
+    // whatever is smaller: coded or stored as is
+    if (CanStore(name)) {
+        auto coded_bits = CodedEntrySize(model.frequencies, code_table, is_last);
+        auto stored = StoredEntrySize(archive_.output.Tell(), name.size(), model.data_size) < coded_bits;
+        // The padding of a stored entry, 0 to 7 bits, depends on where it starts. A part that it decides for is
+        // stored, so that Stitch can code it from there
+        auto least_padded = StoredEntrySize(BitStream::CHAR_SIZE - 1, name.size(), model.data_size) < coded_bits;
+        auto most_padded = StoredEntrySize(0, name.size(), model.data_size) < coded_bits;
+        if (part != nullptr && least_padded != most_padded) {
+            stored = true;
+            part->lengths = model.lengths;
+            part->coded_statistics.coded_bits = CodeLengths::CodedSize(model.frequencies, model.lengths);
+            part->coded_statistics.optimal_coded_bits = model.optimal_coded_bits;
+        }
+        decision_ = {.stored = stored, .name_size = name.size(), .data_size = model.data_size, .coded_bits = coded_bits};
+    }
+    if (decision_.has_value() && decision_->stored) {
+        OutputStored(name, input, model.data_size);
+        archive_.output.WriteSome(is_last ? ARCHIVE_END : ONE_MORE_FILE, 9);
+        ++statistics_.stored_files;
+        statistics_.sample_misses += model.estimate.has_value();
+    } else {
+        statistics_.coded_bits += CodeLengths::CodedSize(model.frequencies, model.lengths);
+        statistics_.optimal_coded_bits += model.optimal_coded_bits;
+
+        OutputTable(archive_, code_table);
+
+        // encoding
+        for (uint8_t symbol : name) {
+            Output(archive_, code_table[symbol]);
+        }
+        Output(archive_, code_table[FILENAME_END]);
+        std::vector<BitStream::CharType> block(READ_BLOCK_SIZE);
+        while (auto count = input.ReadBytes(block)) {
+            Output(archive_, code_table, std::span(block.data(), count));
+        }
+        Output(archive_, code_table[is_last ? ARCHIVE_END : ONE_MORE_FILE]);
+    }
+
+    if (model.estimate.has_value()) {
+        ++statistics_.sampled_scanned_files;
+        statistics_.sample_entropy_error += std::abs(*model.estimate - model.entropy);
+    }
+}
+
+Encoder::Model Encoder::Classify(Encoder::InputStream& file, const Encoder::Options& options) {
+    Model model;
+    model.estimate = EstimateEntropy(file.input, options);
+    if (model.estimate.has_value() && *model.estimate >= INCOMPRESSIBLE_ENTROPY && CanStore(file.name)) {
+        model.stored_on_estimate = true;
+        model.data_size = file.input.SizeHint();
+        return model;
+    }
+    auto size = file.input.SizeHint();
+    if (options.block_size != 0 && (size == 0 || size > options.block_size) && CanStore(file.name)) {
+        model.blocked = true;
+    }
+    return model;
+}
+
+Encoder::Model Encoder::BuildModel(Encoder::InputStream& file, const Encoder::Options& options,
+                                   const Encoder::BlockCallback& on_block, const Encoder::Model* classified) {
+    auto model = classified != nullptr ? *classified : Classify(file, options);
+    if (model.stored_on_estimate || model.blocked) {
+        return model;
+    }
+    auto size = file.input.SizeHint();
 
     // frequencies calculation
-    std::vector<FrequencyType> frequencies(alphabet_size);
+    auto& frequencies = model.frequencies;
     frequencies[FILENAME_END] = 1;
     frequencies[ONE_MORE_FILE] = 1;
     frequencies[ARCHIVE_END] = 1;
@@ -23,116 +714,552 @@ void Encoder::EncodeFile(Encoder::InputStream&& file, bool is_last) {
     for (uint8_t symbol : file.name) {
         ++frequencies[symbol];
     }
-    while (true) {
-        auto [now, result] = file.input.ReadSome(8);
-        if (!result) {
-            break;
+    Histogram::Counts counts;
+    if (!on_block && options.histogram_threads > 1 && size >= PARALLEL_HISTOGRAM_MIN_SIZE && file.input.CanReadAt()) {
+        counts = CountInParallel(file.input, size, options.histogram_threads, model.range_reads);
+    } else {
+        std::vector<BitStream::CharType> block(READ_BLOCK_SIZE);
+        Histogram histogram;
+        while (auto count = file.input.ReadBytes(block)) {
+            histogram.Add(std::span(block.data(), count));
+            if (on_block) {
+                on_block(std::span(block.data(), count));
+            }
         }
-        ++frequencies[now];
+        counts = histogram.GetCounts();
+    }
+    for (size_t i = 0; i < Histogram::SYMBOLS; ++i) {
+        frequencies[i] += counts[i];
+        model.data_size += counts[i];
+    }
+    if (model.estimate.has_value()) {
+        model.entropy = Histogram::Entropy(counts);
     }
 
-    // trie building
-    MinHeap<QueueKey> priority_queue;
-    for (size_t i = 0; i < alphabet_size; ++i) {
-        if (frequencies[i] == 0) {
-            continue;
-        }
-        QueueKey current(frequencies[i], Trie<size_t>(i));
-        priority_queue.Insert(std::move(current));
+    // code generation
+    model.lengths = CodeLengths::Build(frequencies, options.code_lengths);
+    model.optimal_coded_bits = CodeLengths::CodedSize(frequencies, model.lengths);
+    if (options.max_code_length != 0 &&
+        *std::max_element(model.lengths.begin(), model.lengths.end()) > options.max_code_length) {
+        model.lengths = CodeLengths::Limited(frequencies, options.max_code_length);
     }
+    return model;
+}
 
-    while (priority_queue.Size() > 1) {
-        auto l = priority_queue.Extract();
-        auto r = priority_queue.Extract();
-        QueueKey current(l.first + r.first, Trie<size_t>(std::move(l.second), std::move(r.second)));
-        priority_queue.Insert(std::move(current));
+std::optional<double> Encoder::EstimateEntropy(BitReader& input, const Encoder::Options& options) {
+    auto size = input.SizeHint();
+    if (options.sample_size == 0 || size <= options.sample_size || !input.CanSeekBits()) {
+        return std::nullopt;
     }
 
-    auto trie = priority_queue.Extract().second;
+    auto window = std::min(SAMPLE_WINDOW_SIZE, options.sample_size);
+    auto windows = options.sample_size / window;
+    std::vector<BitStream::CharType> block(window);
+    Histogram histogram;
+    size_t sampled = 0;
+    for (size_t i = 0; i < windows; ++i) {
+        input.SeekBits(i * (size / windows) * BitStream::CHAR_SIZE);
+        auto count = input.ReadBytes(block);
+        histogram.Add(std::span(block.data(), count));
+        sampled += count;
+    }
+    input.Restore();
 
-    // code generation
-    std::vector<Code> codes;
-    trie.GenerateCodes(codes);
-    std::sort(codes.begin(), codes.end(), [](const Code& a, const Code& b) {
-        return std::make_tuple(a.second.size(), a.first) < std::make_tuple(b.second.size(), b.first);
-    });
+    // Miller-Madow correction: a sample misses some of the rarer bytes, and underestimates entropy
+    const auto& counts = histogram.GetCounts();
+    auto seen = std::count_if(counts.begin(), counts.end(), [](Histogram::CountType count) { return count != 0; });
+    auto correction = static_cast<double>(seen - 1) / (2 * static_cast<double>(sampled) * std::log(2));
+    return Histogram::Entropy(counts) + correction;
+}
 
-    std::vector<bool> current_code(1, false);
-    for (auto& [key, code] : codes) {
-        while (current_code.size() < code.size()) {
-            current_code.push_back(false);
-        }
-        code = current_code;
-        size_t i = current_code.size() - 1;
-        while (true) {
-            current_code[i] = !current_code[i];
-            if (current_code[i] == 1 || i == 0) {
-                break;
+bool Encoder::CanStore(const std::string& name) {
+    return name.size() < (size_t(1) << STORED_NAME_SIZE_BITS);
+}
+
+Encoder::BlockModel Encoder::BuildBlockModel(std::span<const BitStream::CharType> block,
+                                             const Encoder::Options& options) {
+    BlockModel model;
+    Histogram histogram;
+    histogram.Add(block);
+    const auto& counts = histogram.GetCounts();
+    std::copy(counts.begin(), counts.end(), model.frequencies.begin());
+
+    model.lengths = CodeLengths::Build(model.frequencies, options.code_lengths);
+    model.optimal_coded_bits = CodeLengths::CodedSize(model.frequencies, model.lengths);
+    auto max_length = *std::max_element(model.lengths.begin(), model.lengths.end());
+    if (options.max_code_length != 0 && max_length > options.max_code_length) {
+        model.lengths = CodeLengths::Limited(model.frequencies, options.max_code_length);
+        max_length = *std::max_element(model.lengths.begin(), model.lengths.end());
+    }
+
+    size_t symbols = std::count_if(model.lengths.begin(), model.lengths.end(), [](size_t length) { return length != 0; });
+    auto coded_bits = 9 * (1 + symbols + max_length) + CodeLengths::CodedSize(model.frequencies, model.lengths);
+    // the payload starts on a byte boundary, STORED_ENTRY is padded to the next one
+    auto stored_bits = 2 * BitStream::CHAR_SIZE + BitStream::CHAR_SIZE * block.size();
+    model.stored = stored_bits <= coded_bits;
+    model.payload_bits = std::min(stored_bits, coded_bits);
+    return model;
+}
+
+size_t Encoder::BlockSize(const Encoder::BlockModel& model) {
+    auto payload = (model.payload_bits + BitStream::CHAR_SIZE - 1) / BitStream::CHAR_SIZE * BitStream::CHAR_SIZE;
+    return 2 * BLOCK_SIZE_BITS + payload;
+}
+
+Encoder::SizePrediction Encoder::PredictSize(size_t count, const Encoder::FileOpener& open,
+                                             const Encoder::Options& options, size_t threads) {
+    // All that is kept of a Model: entries are sized in order once every file is scanned
+    struct Sizes {
+        bool stored_on_estimate = false;
+        bool blocked = false;
+        bool can_store = false;
+        size_t name_size = 0;
+        size_t data_size = 0;
+        size_t coded_bits = 0;
+        size_t last_coded_bits = 0;
+        size_t blocks_bits = 0;
+    };
+    std::vector<Sizes> sizes(count);
+    auto file_options = options;
+    if (threads > 1 && count > 1) {
+        file_options.histogram_threads = 1;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto scan = [&] {
+        for (auto i = next++; i < count; i = next++) {
+            try {
+                auto file = open(i);
+                auto model = BuildModel(file, file_options, {});
+                auto& current = sizes[i];
+                current.stored_on_estimate = model.stored_on_estimate;
+                current.can_store = CanStore(file.name);
+                current.name_size = file.name.size();
+                current.data_size = model.data_size;
+                current.blocked = model.blocked;
+                if (model.blocked) {
+                    std::vector<BitStream::CharType> block(options.block_size);
+                    while (auto read = file.input.ReadBytes(block)) {
+                        current.blocks_bits += BlockSize(BuildBlockModel(std::span(block.data(), read), options));
+                    }
+                } else if (!model.stored_on_estimate) {
+                    CanonicalCode code_table(model.lengths);
+                    current.coded_bits = CodedEntrySize(model.frequencies, code_table, false);
+                    current.last_coded_bits = CodedEntrySize(model.frequencies, code_table, true);
+                }
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (error == nullptr) {
+                    error = std::current_exception();
+                }
+                next = count;
             }
-            --i;
         }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min(threads, count); ++i) {
+        workers.emplace_back(scan);
+    }
+    scan();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (error != nullptr) {
+        std::rethrow_exception(error);
     }
 
-    // restore information output
-    std::vector<size_t> sizes(alphabet_size);
-    size_t max_size = 0;
-    archive_.output.WriteSome(codes.size(), 9);
-    for (auto& [key, code] : codes) {
-        archive_.output.WriteSome(key, 9);
-        max_size = std::max(max_size, code.size() - 1);
-        ++sizes[code.size() - 1];
+    SizePrediction prediction;
+    size_t position = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const auto& current = sizes[i];
+        auto coded_bits = (i + 1 == count) ? current.last_coded_bits : current.coded_bits;
+        auto stored_bits = StoredEntrySize(position, current.name_size, current.data_size);
+        SizePrediction::Entry entry{.bits = coded_bits, .stored = false};
+        if (current.blocked) {
+            entry.bits = BlockedEntrySize(position, current.name_size, current.blocks_bits);
+        } else if (current.stored_on_estimate || (current.can_store && stored_bits < coded_bits)) {
+            entry = {.bits = stored_bits, .stored = true};
+        }
+        prediction.entries.push_back(entry);
+        position += entry.bits;
     }
-    for (size_t i = 0; i <= max_size; ++i) {
-        archive_.output.WriteSome(sizes[i], 9);
+    prediction.archive_bytes = (position + BitStream::CHAR_SIZE - 1) / BitStream::CHAR_SIZE;
+    return prediction;
+}
+
+Encoder::Statistics Encoder::GetStatistics() const {
+    auto statistics = statistics_;
+    statistics.output_writes = archive_.output.IoCalls();
+    return statistics;
+}
+
+size_t Encoder::CodedEntrySize(const CodeLengths::Frequencies& frequencies, const CanonicalCode& code_table,
+                               bool is_last) {
+    auto table = 9 * (1 + code_table.Symbols().size() + code_table.LengthCounts().size());
+    // frequencies count both end markers, only one is written
+    auto unused_marker = code_table[is_last ? ONE_MORE_FILE : ARCHIVE_END].length;
+    size_t data = 0;
+    for (auto symbol : code_table.Symbols()) {
+        data += frequencies[symbol] * code_table[symbol].length;
     }
+    return table + data - unused_marker;
+}
+
+size_t Encoder::StoredEntrySize(size_t position, size_t name_size, size_t data_size) {
+    auto header = 9;
+    auto padding = (BitStream::CHAR_SIZE - (position + header) % BitStream::CHAR_SIZE) % BitStream::CHAR_SIZE;
+    return header + padding + STORED_NAME_SIZE_BITS + 64 + BitStream::CHAR_SIZE * (name_size + data_size) + 9;
+}
 
-    std::map<size_t, std::vector<bool>> code_map;
-    for (auto& [key, code] : codes) {
-        code_map[key] = code;
+size_t Encoder::BlockedEntrySize(size_t position, size_t name_size, size_t blocks_bits) {
+    auto header = 9;
+    auto padding = (BitStream::CHAR_SIZE - (position + header) % BitStream::CHAR_SIZE) % BitStream::CHAR_SIZE;
+    return header + padding + STORED_NAME_SIZE_BITS + BitStream::CHAR_SIZE * name_size + blocks_bits +
+           BLOCK_SIZE_BITS + 9;
+}
+
+void Encoder::OutputStored(const std::string& name, BitReader& input, size_t data_size) {
+    auto& output = archive_.output;
+    OutputStoredHeader(archive_, name, data_size);
+
+    std::vector<BitStream::CharType> block(READ_BLOCK_SIZE);
+    size_t written = 0;
+    while (auto count = input.ReadBytes(block)) {
+        output.WriteBytes(std::span(block.data(), count));
+        written += count;
+    }
+    if (written != data_size) {
+        throw std::runtime_error("input changed between the passes: " + name);
     }
+}
 
-    // encoding
-    file.input.Restore();
-    for (uint8_t symbol : file.name) {
-        Output(archive_, code_map[symbol]);
+void Encoder::OutputStoredHeader(Encoder::OutputStream& target, const std::string& name, size_t data_size) {
+    auto& output = target.output;
+    output.WriteSome(STORED_ENTRY, 9);
+    output.Align();
+    output.WriteSome(name.size(), STORED_NAME_SIZE_BITS);
+    output.WriteSome(static_cast<uint32_t>(data_size >> 32), 32);
+    output.WriteSome(static_cast<uint32_t>(data_size), 32);
+    output.WriteBytes(name);
+}
+
+void Encoder::EncodeBlocked(const std::string& name, BitReader& input, bool is_last) {
+    OutputBlockedStart(name);
+    if (options_.block_threads > 1) {
+        EncodeBlocksInParallel(input);
+    } else if (options_.pipeline_depth != 0) {
+        EncodeBlocksPipelined(input);
+    } else {
+        std::vector<BitStream::CharType> block(options_.block_size);
+        while (auto count = input.ReadBytes(block)) {
+            OutputBlock(EncodeBlock(std::span(block.data(), count), options_));
+        }
     }
-    Output(archive_, code_map[FILENAME_END]);
-    while (true) {
-        auto [now, result] = file.input.ReadSome(8);
-        if (!result) {
-            break;
+    OutputBlockedEnd(is_last);
+}
+
+void Encoder::OutputBlockedStart(const std::string& name) {
+    auto& output = archive_.output;
+    output.WriteSome(BLOCKED_ENTRY, 9);
+    output.Align();
+    output.WriteSome(name.size(), STORED_NAME_SIZE_BITS);
+    output.WriteBytes(name);
+}
+
+void Encoder::OutputBlockedEnd(bool is_last) {
+    archive_.output.WriteSome(0, BLOCK_SIZE_BITS);
+    archive_.output.WriteSome(is_last ? ARCHIVE_END : ONE_MORE_FILE, 9);
+}
+
+void Encoder::EncodeBlocksInParallel(BitReader& input) {
+    // Blocks read and not appended yet, in order. References to them stay valid while others are added or removed
+    struct Slot {
+        std::vector<BitStream::CharType> data;
+        std::optional<EncodedBlock> encoded;
+    };
+    const size_t window = 2 * options_.block_threads;
+    std::deque<Slot> in_flight;
+    std::deque<Slot*> pending;
+    std::vector<std::vector<BitStream::CharType>> free_buffers;
+    std::mutex mutex;
+    std::condition_variable block_read;
+    std::condition_variable block_done;
+    bool input_ended = false;
+    std::exception_ptr error;
+
+    auto encode = [&] {
+        std::unique_lock lock(mutex);
+        while (true) {
+            block_read.wait(lock, [&] { return !pending.empty() || input_ended || error != nullptr; });
+            if (pending.empty() || error != nullptr) {
+                return;
+            }
+            auto* slot = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            try {
+                auto encoded = EncodeBlock(slot->data, options_);
+                lock.lock();
+                slot->encoded = std::move(encoded);
+            } catch (...) {
+                lock.lock();
+                if (error == nullptr) {
+                    error = std::current_exception();
+                }
+            }
+            block_done.notify_all();
         }
-        Output(archive_, code_map[now]);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < options_.block_threads; ++i) {
+        workers.emplace_back(encode);
     }
 
-    if (is_last) {
-        Output(archive_, code_map[ARCHIVE_END]);
-        archive_.output.Flush();
-    } else {
-        Output(archive_, code_map[ONE_MORE_FILE]);
+    try {
+        bool reading = true;
+        while (true) {
+            while (reading && in_flight.size() < window) {
+                std::vector<BitStream::CharType> data;
+                if (!free_buffers.empty()) {
+                    data = std::move(free_buffers.back());
+                    free_buffers.pop_back();
+                }
+                data.resize(options_.block_size);
+                auto count = input.ReadBytes(data);
+                if (count == 0) {
+                    reading = false;
+                    break;
+                }
+                data.resize(count);
+                std::lock_guard lock(mutex);
+                in_flight.push_back({.data = std::move(data), .encoded = std::nullopt});
+                pending.push_back(&in_flight.back());
+                block_read.notify_one();
+            }
+            if (in_flight.empty()) {
+                break;
+            }
+
+            std::unique_lock lock(mutex);
+            block_done.wait(lock, [&] { return in_flight.front().encoded.has_value() || error != nullptr; });
+            if (error != nullptr) {
+                break;
+            }
+            auto encoded = std::move(*in_flight.front().encoded);
+            free_buffers.push_back(std::move(in_flight.front().data));
+            in_flight.pop_front();
+            lock.unlock();
+            OutputBlock(encoded);
+        }
+    } catch (...) {
+        std::lock_guard lock(mutex);
+        if (error == nullptr) {
+            error = std::current_exception();
+        }
+    }
+    {
+        std::lock_guard lock(mutex);
+        input_ended = true;
+    }
+    block_read.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (error != nullptr) {
+        std::rethrow_exception(error);
     }
 }
 
-void Encoder::Output(Encoder::OutputStream& target, const std::vector<bool>& code) {
-    BitWriter::InputType current = 0;
-    BitStream::Size current_put = 0;
-    BitStream::Size i = 0;
-    BitStream::Size per_put = BitWriter::MAX_PUT_REQUEST;
+void Encoder::EncodeBlocksPipelined(BitReader& input) {
+    using Buffer = std::vector<BitStream::CharType>;
+    struct Modeled {
+        Buffer data;
+        BlockModel model;
+    };
+    const auto depth = options_.pipeline_depth;
+    // Filled and in each ring, and one in each stage: the reader allocates no more
+    const auto buffers = 2 * depth + 3;
+    SpscRing<Buffer> read(depth);
+    SpscRing<Modeled> modeled(depth);
+    SpscRing<EncodedBlock> encoded(depth);
+    // Data buffers back to the reader once encoded
+    SpscRing<Buffer> recycled(buffers);
+
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto fail = [&] {
+        std::lock_guard lock(mutex);
+        if (error == nullptr) {
+            error = std::current_exception();
+        }
+    };
+
+    // Stages stop as described on SpscRing
+    std::thread reader([&] {
+        try {
+            size_t allocated = 0;
+            while (true) {
+                Buffer data;
+                if (allocated < buffers) {
+                    ++allocated;
+                } else if (!recycled.Pop(data)) {
+                    break;
+                }
+                data.resize(options_.block_size);
+                auto count = input.ReadBytes(data);
+                if (count == 0) {
+                    break;
+                }
+                data.resize(count);
+                if (!read.Push(data)) {
+                    break;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+        recycled.Cancel();
+        read.Close();
+    });
+    std::thread modeler([&] {
+        try {
+            Buffer data;
+            while (read.Pop(data)) {
+                auto model = BuildBlockModel(data, options_);
+                if (!modeled.Push({.data = std::move(data), .model = model})) {
+                    break;
+                }
+            }
+        } catch (...) {
+            fail();
+        }
+        read.Cancel();
+        modeled.Close();
+    });
+    std::thread coder([&] {
+        try {
+            Modeled block;
+            while (modeled.Pop(block)) {
+                if (!encoded.Push(EncodeBlock(block.data, block.model))) {
+                    break;
+                }
+                recycled.Push(block.data);
+            }
+        } catch (...) {
+            fail();
+        }
+        modeled.Cancel();
+        encoded.Close();
+        recycled.Close();
+    });
+
+    try {
+        EncodedBlock block;
+        while (encoded.Pop(block)) {
+            OutputBlock(block);
+        }
+    } catch (...) {
+        fail();
+    }
+    encoded.Cancel();
+    reader.join();
+    modeler.join();
+    coder.join();
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+}
 
-    while (i < code.size()) {
-        current <<= 1;
-        current ^= code[i];
-        ++i;
-        ++current_put;
+Encoder::EncodedBlock Encoder::EncodeBlock(std::span<const BitStream::CharType> block, const Encoder::Options& options) {
+    return EncodeBlock(block, BuildBlockModel(block, options));
+}
 
-        if (current_put == per_put) {
-            target.output.WriteSome(current, current_put);
-            current = 0;
-            current_put = 0;
+Encoder::EncodedBlock Encoder::EncodeBlock(std::span<const BitStream::CharType> block, const Encoder::BlockModel& model) {
+    EncodedBlock encoded;
+    // the exact size, the sink does not grow
+    encoded.bytes.reserve(BlockSize(model) / BitStream::CHAR_SIZE);
+    {
+        OutputStream target{.output = BitWriter(std::make_unique<MemorySink>(encoded.bytes))};
+        auto& output = target.output;
+        output.WriteSome(block.size(), BLOCK_SIZE_BITS);
+        output.WriteSome(model.payload_bits, BLOCK_SIZE_BITS);
+        if (model.stored) {
+            output.WriteSome(STORED_ENTRY, 9);
+            output.Align();
+            output.WriteBytes(block);
+            ++encoded.statistics.stored_blocks;
+        } else {
+            CanonicalCode code_table(model.lengths);
+            OutputTable(target, code_table);
+            Output(target, code_table, block);
+            encoded.statistics.coded_bits += CodeLengths::CodedSize(model.frequencies, model.lengths);
+            encoded.statistics.optimal_coded_bits += model.optimal_coded_bits;
+            ++encoded.statistics.coded_blocks;
         }
+        // pads the block to a byte boundary
+        output.Flush();
+    }
+    return encoded;
+}
+
+void Encoder::OutputBlock(const Encoder::EncodedBlock& block) {
+    archive_.output.WriteBytes(block.bytes);
+    AddStatistics(statistics_, block.statistics);
+}
+
+void Encoder::OutputTable(Encoder::OutputStream& target, const CanonicalCode& code_table) {
+    target.output.WriteSome(code_table.Symbols().size(), 9);
+    for (auto symbol : code_table.Symbols()) {
+        target.output.WriteSome(symbol, 9);
+    }
+    for (auto count : code_table.LengthCounts()) {
+        target.output.WriteSome(count, 9);
+    }
+}
+
+void Encoder::Output(Encoder::OutputStream& target, const CanonicalCode& code_table,
+                     std::span<const BitStream::CharType> block) {
+    // As many codes per Append as the longest one allows
+    size_t done = 0;
+    switch (BitWriter::MAX_APPEND_REQUEST / std::max<size_t>(code_table.LengthCounts().size(), 1)) {
+        case 0:
+        case 1:
+            break;
+        case 2:
+            done = OutputPacked<2>(target.output, code_table, block);
+            break;
+        case 3:
+            done = OutputPacked<3>(target.output, code_table, block);
+            break;
+        default:
+            done = OutputPacked<4>(target.output, code_table, block);
+            break;
+    }
+    for (auto symbol : block.subspan(done)) {
+        Output(target, code_table[static_cast<uint8_t>(symbol)]);
+    }
+}
+
+void Encoder::Output(Encoder::OutputStream& target, const CanonicalCode::Entry& code) {
+    if (code.length <= BitWriter::MAX_APPEND_REQUEST) {
+        target.output.Append(code.code, code.length);
+        return;
     }
 
-    if (current_put != 0) {
-        target.output.WriteSome(current, current_put);
+    // Bits above CanonicalCode::CODE_SIZE are all ones
+    const auto ones = (static_cast<BitWriter::AccumulatorType>(1) << BitWriter::MAX_APPEND_REQUEST) - 1;
+    auto left = code.length;
+    while (left > CanonicalCode::CODE_SIZE) {
+        auto current = std::min(left - CanonicalCode::CODE_SIZE, BitWriter::MAX_APPEND_REQUEST);
+        target.output.Append(ones >> (BitWriter::MAX_APPEND_REQUEST - current), current);
+        left -= current;
+    }
+    auto low = std::min(left, CanonicalCode::CODE_SIZE / 2);
+    auto high = left - low;
+    if (high != 0) {
+        target.output.Append((code.code >> low) & ((static_cast<BitWriter::AccumulatorType>(1) << high) - 1), high);
     }
+    target.output.Append(code.code & ((static_cast<BitWriter::AccumulatorType>(1) << low) - 1), low);
 }
@@ -1,21 +1,49 @@
 #pragma once
 
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
 #include <vector>
-#include <map>
 
 #include "bit_reader.h"
 #include "bit_writer.h"
+#include "canonical_code.h"
+#include "code_lengths.h"
 
 class Encoder {
 public:
     using FrequencyType = uint64_t;
-    using Code = std::pair<size_t, std::vector<bool>>;
-    using CodeTable = std::map<size_t, std::vector<bool>>;
 
-    const uint32_t FILENAME_END = 256;
-    const uint32_t ONE_MORE_FILE = 257;
-    const uint32_t ARCHIVE_END = 258;
+    static constexpr uint32_t FILENAME_END = 256;
+    static constexpr uint32_t ONE_MORE_FILE = 257;
+    static constexpr uint32_t ARCHIVE_END = 258;
+    // In place of the symbol count: the entry is stored as is. From the next byte boundary on it holds the name size
+    // (STORED_NAME_SIZE_BITS), the data size (64 bits), the name and the data, and ends with ONE_MORE_FILE or ARCHIVE_END
+    static constexpr uint32_t STORED_ENTRY = 511;
+    static constexpr size_t STORED_NAME_SIZE_BITS = 16;
+    // In place of the symbol count: the entry is coded in blocks of data, each with its own table. From the next byte
+    // boundary on it holds the name size (STORED_NAME_SIZE_BITS) and the name, then the blocks. A block starts with its
+    // data size and the size in bits of the rest of it (BLOCK_SIZE_BITS each). Then come a table and the codes, or
+    // STORED_ENTRY and the data as is from the next byte boundary, padded to a byte boundary. A block of data size 0
+    // ends the blocks and is followed by ONE_MORE_FILE or ARCHIVE_END
+    static constexpr uint32_t BLOCKED_ENTRY = 510;
+    static constexpr size_t BLOCK_SIZE_BITS = 32;
+    // Smallest file whose frequency pass is split over Options::histogram_threads
+    static constexpr size_t PARALLEL_HISTOGRAM_MIN_SIZE = size_t(1) << 20;
+    // Keeps the size in bits of any block within BLOCK_SIZE_BITS
+    static constexpr size_t MAX_BLOCK_SIZE = size_t(1) << 28;
+    // EncodeFiles keeps an entry encoded ahead of its turn in memory up to this many bytes, in a temporary file past it
+    static constexpr size_t PART_MEMORY_SIZE = size_t(1) << 22;
+
+    // Input is scanned in blocks of this many bytes
+    static const size_t READ_BLOCK_SIZE = 1 << 16;
+    // Sampling reads windows of this many bytes
+    static constexpr size_t SAMPLE_WINDOW_SIZE = 1 << 12;
+    // Sampled files with at least this estimated entropy, in bits per byte, are stored without a frequency pass
+    static constexpr double INCOMPRESSIBLE_ENTROPY = 7.95;
 
     struct InputStream {
         std::string name;
@@ -24,8 +52,77 @@ public:
     struct OutputStream {
         BitWriter output;
     };
+    struct Statistics {
+        size_t input_reads = 0;
+        size_t output_writes = 0;
+        // Written to temporary files: inputs that cannot seek, and entries of EncodeFiles encoded ahead of their turn
+        size_t spilled_bytes = 0;
+        // Size of the coded data, and what it would be without Options::max_code_length
+        size_t coded_bits = 0;
+        size_t optimal_coded_bits = 0;
+        size_t stored_files = 0;
+        // Sampling: files stored on the estimate alone, and files sampled and then scanned in full.
+        // For the latter, how many were stored after all and the sum of the entropy estimate errors, bits per byte
+        size_t sampled_stored_files = 0;
+        size_t sampled_scanned_files = 0;
+        size_t sample_misses = 0;
+        double sample_entropy_error = 0;
+        size_t coded_blocks = 0;
+        size_t stored_blocks = 0;
+        // Workers of a parallel EncodeFiles: tasks run, how many of them were stolen from other workers, and the
+        // share of the time spent running them
+        struct Worker {
+            size_t tasks = 0;
+            size_t stolen = 0;
+            double utilization = 0;
+        };
+        std::vector<Worker> workers;
+    };
+    struct Options {
+        // Files up to this many bytes are read once: the frequency pass keeps them in memory for the encoding pass.
+        // Larger files are read twice, 0 reads every file twice. Inputs that cannot seek are spilled to a temporary
+        // file past the limit
+        size_t single_read_limit = 0;
+        CodeLengths::Builder code_lengths = CodeLengths::Builder::TRIE;
+        // Longest code allowed, at least CodeLengths::MIN_LENGTH_LIMIT. 0 for no limit
+        size_t max_code_length = 0;
+        // Bytes sampled, in windows spread over the file, to estimate its entropy before the frequency pass.
+        // 0 turns sampling off. Files not larger than this, of unknown size or that can only rewind are not sampled
+        size_t sample_size = 0;
+        // Files larger than this many bytes or of unknown size are coded in blocks of it, see BLOCKED_ENTRY. Their data
+        // is read once and only a block of it is kept in memory. 0 codes every file with a single table. At most
+        // MAX_BLOCK_SIZE
+        size_t block_size = 0;
+        // Blocks of a file are encoded on this many threads while it is read. EncodeFiles encodes the blocks of each
+        // file on a single thread when it runs several files at once
+        size_t block_threads = 1;
+        // The frequency pass of a file of known size, at least PARALLEL_HISTOGRAM_MIN_SIZE, counts this many ranges of
+        // it at once, each into its own Histogram. Only when the input can be read at any offset (ByteSource::CanReadAt)
+        // and the encoding pass reads it again. EncodeFiles and PredictSize count on a single thread per file when
+        // they run several files at once
+        size_t histogram_threads = 1;
+        // When not 0 and blocks are encoded on a single thread, the blocks of a file are read, modeled, encoded and
+        // appended in a pipeline, with up to this many blocks queued between stages. EncodeFiles runs no pipelines
+        // when it runs several files at once
+        size_t pipeline_depth = 0;
+    };
+    // Archive that EncodeFile would write for a list of files
+    struct SizePrediction {
+        struct Entry {
+            size_t bits = 0;
+            bool stored = false;
+        };
+        std::vector<Entry> entries;
+        size_t archive_bytes = 0;
+    };
+    // Opens the file at `index` of the list, as it would be passed to EncodeFile. EncodeFiles and PredictSize call it
+    // from several threads at once, once per file
+    using FileOpener = std::function<InputStream(size_t index)>;
+    // Expected size in bytes of the file at `index`
+    using FileSizer = std::function<size_t(size_t index)>;
 
     explicit Encoder(OutputStream&& archive);
+    Encoder(OutputStream&& archive, const Options& options);
     Encoder(const Encoder& other) = delete;
     Encoder(Encoder&& other) = default;
 
@@ -34,9 +131,139 @@ public:
     ~Encoder() = default;
 
     void EncodeFile(InputStream&& file, bool is_last);
+    // Same as EncodeFile for each of `count` files in order, the last one included. With more than one thread, files
+    // are encoded by a work-stealing TaskPool of `threads` workers and appended to the archive in order. The next file
+    // to append goes straight into the archive, encoded by the calling thread, when no worker has started it. Others
+    // are encoded ahead of their turn, up to PART_MEMORY_SIZE bytes of each in memory and the rest in a temporary
+    // file. Files coded in blocks that can be read at any offset are split into a task per block, which idle workers
+    // steal. Files are taken within 2 * `threads` of the next one to append, the largest first when `size_of` is
+    // given, and up to 2 * `threads` blocks wait in memory until they are appended
+    void EncodeFiles(size_t count, const FileOpener& open, size_t threads, const FileSizer& size_of = {});
+
+    Statistics GetStatistics() const;
+
+    // Exact size of the archive for `count` files with `options`, from the frequency pass alone: nothing is coded or
+    // written. Up to `threads` files are scanned at once
+    static SizePrediction PredictSize(size_t count, const FileOpener& open, const Options& options, size_t threads);
+
+    // Exact sizes of an entry in bits, with its table and coded data or stored. A stored entry also depends on
+    // `position`, the bit of the archive it starts at
+    static size_t CodedEntrySize(const CodeLengths::Frequencies& frequencies, const CanonicalCode& code_table,
+                                 bool is_last);
+    static size_t StoredEntrySize(size_t position, size_t name_size, size_t data_size);
+    // `blocks_bits` is the size of the blocks, padding included
+    static size_t BlockedEntrySize(size_t position, size_t name_size, size_t blocks_bits);
+
+    // One code, split over several BitWriter::Append when it is longer than BitWriter::MAX_APPEND_REQUEST
+    static void Output(OutputStream& target, const CanonicalCode::Entry& code);
+    // Codes of a block of input bytes, several of them per BitWriter::Append when they are short enough
+    static void Output(OutputStream& target, const CanonicalCode& code_table, std::span<const BitStream::CharType> block);
 
 private:
-    static void Output(OutputStream& target, const std::vector<bool>& code);
+    // What EncodeFile decides from sampling and the frequency pass, before anything is written
+    struct Model {
+        std::optional<double> estimate;
+        // When either is set there was no frequency pass: the file is stored on the estimate, or coded in blocks
+        bool stored_on_estimate = false;
+        bool blocked = false;
+        size_t data_size = 0;
+        CodeLengths::Frequencies frequencies{};
+        CanonicalCode::Lengths lengths{};
+        size_t optimal_coded_bits = 0;
+        double entropy = 0;
+        // Issued by a parallel frequency pass, which does not go through BitReader::IoCalls
+        size_t range_reads = 0;
+    };
+    // Code for one block of a blocked entry
+    struct BlockModel {
+        CodeLengths::Frequencies frequencies{};
+        CanonicalCode::Lengths lengths{};
+        size_t optimal_coded_bits = 0;
+        bool stored = false;
+        // Size of the table and the codes, or of the stored data, without the block sizes and the padding
+        size_t payload_bits = 0;
+    };
+    // Block of a blocked entry, ready to be appended
+    struct EncodedBlock {
+        std::vector<BitStream::CharType> bytes;
+        Statistics statistics;
+    };
+    // Choice between coding and storing a scanned file. The size of the stored entry depends on where it starts
+    struct StoreDecision {
+        bool stored = false;
+        size_t name_size = 0;
+        size_t data_size = 0;
+        size_t coded_bits = 0;
+    };
+    // Entry encoded on its own, as if it started the archive. Its bytes are in `bytes`, or in `spill` once there are
+    // more than PART_MEMORY_SIZE of them
+    struct Part {
+        std::vector<BitStream::CharType> bytes;
+        std::unique_ptr<FILE, decltype(&std::fclose)> spill{nullptr, &std::fclose};
+        size_t bits = 0;
+        std::optional<StoreDecision> decision;
+        Statistics statistics;
+        // Set when the choice between coding and storing depends on where the entry starts. The part holds it stored,
+        // and where coding is smaller Stitch codes it with these lengths instead, with `coded_statistics`
+        std::optional<CanonicalCode::Lengths> lengths;
+        Statistics coded_statistics;
+    };
+    using BlockCallback = std::function<void(std::span<const BitStream::CharType>)>;
+
+    // Samples `file`, then runs the frequency pass unless the sample says to store it. Every block read is passed to
+    // `on_block`, if it is set: the frequency pass is then read in order on one thread. `classified`, if set, is what
+    // Classify returned for `file`, which is not sampled again
+    static Model BuildModel(InputStream& file, const Options& options, const BlockCallback& on_block,
+                            const Model* classified = nullptr);
+    // Sampling and whether the file is coded in blocks, without the frequency pass
+    static Model Classify(InputStream& file, const Options& options);
+    // Entropy estimate from Options::sample_size bytes of `input`, if it can be sampled. Leaves `input` restored
+    static std::optional<double> EstimateEntropy(BitReader& input, const Options& options);
+    static bool CanStore(const std::string& name);
+    static BlockModel BuildBlockModel(std::span<const BitStream::CharType> block, const Options& options);
+    // Size of the block in bits, with its sizes and padding
+    static size_t BlockSize(const BlockModel& model);
+    static EncodedBlock EncodeBlock(std::span<const BitStream::CharType> block, const Options& options);
+    static EncodedBlock EncodeBlock(std::span<const BitStream::CharType> block, const BlockModel& model);
+
+    // EncodeFile without the final Flush. A scanned entry is written for any position when `part` is set, see
+    // EncodeScanned. See BuildModel for `classified`
+    void EncodeEntry(InputStream& file, bool is_last, Part* part = nullptr, const Model* classified = nullptr);
+    // EncodeEntry straight into the archive, on the calling thread alone
+    void EncodeInTurn(InputStream&& file, bool is_last, const Model* classified = nullptr);
+    // EncodeEntry ahead of its turn, on the calling thread alone. Reads `file` once
+    Part EncodePart(InputStream&& file, bool is_last, const Model* classified = nullptr) const;
+    // Reader of the bytes of `part`, from the beginning
+    static BitReader ReadPart(const Part& part);
+    // Appends an entry from EncodePart as EncodeFile would have written it at this position
+    void Stitch(const Part& part);
+    // The stored entry of `part` coded with `part.lengths`
+    void StitchCoded(const Part& part);
+    static void AddStatistics(Statistics& total, const Statistics& part);
+
+    // The entry coded or stored, whichever is smaller. `input` reads the data again from the beginning. If `part` is
+    // set and the choice would be different at another position, the entry is stored, and `part` gets what Stitch
+    // needs to code it instead
+    void EncodeScanned(const std::string& name, bool is_last, const Model& model, BitReader& input,
+                       Part* part = nullptr);
+    void OutputStored(const std::string& name, BitReader& input, size_t data_size);
+    static void OutputStoredHeader(OutputStream& target, const std::string& name, size_t data_size);
+    void EncodeBlocked(const std::string& name, BitReader& input, bool is_last);
+    // Reads the blocks of `input` and encodes them on Options::block_threads workers, appending them in order
+    void EncodeBlocksInParallel(BitReader& input);
+    // Same, in stages on threads of their own: reading, modeling and encoding blocks, joined by SpscRing queues of
+    // Options::pipeline_depth blocks. The calling thread appends them
+    void EncodeBlocksPipelined(BitReader& input);
+    void OutputBlock(const EncodedBlock& block);
+    // Before and after the blocks of a blocked entry
+    void OutputBlockedStart(const std::string& name);
+    void OutputBlockedEnd(bool is_last);
+
+    static void OutputTable(OutputStream& target, const CanonicalCode& code_table);
 
     OutputStream archive_;
+    Options options_;
+    Statistics statistics_;
+    // Of the last entry, if it was scanned and could be stored
+    std::optional<StoreDecision> decision_;
 };
@@ -0,0 +1,106 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+Histogram::Histogram(Kernel kernel) : kernel_(kernel) {
+    if (kernel_ != Kernel::SIMPLE) {
+        tables_.resize(TABLES);
+    }
+}
+
+void Histogram::Add(std::span<const BitStream::CharType> block) {
+    std::span<const uint8_t> bytes(reinterpret_cast<const uint8_t*>(block.data()), block.size());
+    if (kernel_ == Kernel::SIMPLE) {
+        AddSimple(bytes);
+        return;
+    }
+
+    // every table gets at most a 1 / TABLES share of the bytes, FLUSH_PERIOD keeps away from the limit anyway
+    while (!bytes.empty()) {
+        auto current = std::min(bytes.size(), FLUSH_PERIOD - pending_);
+        if (kernel_ == Kernel::INTERLEAVED) {
+            AddInterleaved(bytes.first(current));
+        } else {
+            AddWords(bytes.first(current));
+        }
+        pending_ += current;
+        bytes = bytes.subspan(current);
+        if (pending_ == FLUSH_PERIOD) {
+            Flush();
+        }
+    }
+}
+
+const Histogram::Counts& Histogram::GetCounts() {
+    Flush();
+    return counts_;
+}
+
+double Histogram::Entropy(const Counts& counts) {
+    double total = 0;
+    for (auto count : counts) {
+        total += static_cast<double>(count);
+    }
+    double entropy = 0;
+    for (auto count : counts) {
+        if (count != 0) {
+            auto probability = static_cast<double>(count) / total;
+            entropy -= probability * std::log2(probability);
+        }
+    }
+    return entropy;
+}
+
+void Histogram::AddSimple(std::span<const uint8_t> block) {
+    for (auto byte : block) {
+        ++counts_[byte];
+    }
+}
+
+void Histogram::AddInterleaved(std::span<const uint8_t> block) {
+    static_assert(TABLES == 8);
+    auto data = block.data();
+    size_t i = 0;
+    for (; i + TABLES <= block.size(); i += TABLES) {
+        ++tables_[0][data[i]];
+        ++tables_[1][data[i + 1]];
+        ++tables_[2][data[i + 2]];
+        ++tables_[3][data[i + 3]];
+        ++tables_[4][data[i + 4]];
+        ++tables_[5][data[i + 5]];
+        ++tables_[6][data[i + 6]];
+        ++tables_[7][data[i + 7]];
+    }
+    for (; i < block.size(); ++i) {
+        ++tables_[0][data[i]];
+    }
+}
+
+void Histogram::AddWords(std::span<const uint8_t> block) {
+    static_assert(TABLES == 8);
+    auto data = block.data();
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= block.size(); i += sizeof(uint64_t)) {
+        // byte order does not matter here, any order of the tables will do
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, sizeof(word));
+        for (size_t j = 0; j < TABLES; ++j) {
+            ++tables_[j][static_cast<uint8_t>(word >> (BitStream::CHAR_SIZE * j))];
+        }
+    }
+    for (; i < block.size(); ++i) {
+        ++tables_[0][block[i]];
+    }
+}
+
+void Histogram::Flush() {
+    for (auto& table : tables_) {
+        for (size_t symbol = 0; symbol < SYMBOLS; ++symbol) {
+            counts_[symbol] += table[symbol];
+        }
+        table.fill(0);
+    }
+    pending_ = 0;
+}
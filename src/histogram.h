@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "bit_stream.h"
+
+// Byte frequencies of a stream of blocks. Besides the plain one-counter-per-byte loop, kernels spread
+// consecutive bytes over several tables of 32-bit counters: a run of equal bytes then increments different
+// memory cells instead of waiting on the store of the previous increment. Tables are merged into 64-bit totals
+// before the 32-bit counters could overflow and on Counts()
+class Histogram {
+public:
+    using CountType = uint64_t;
+    static constexpr size_t SYMBOLS = 256;
+    using Counts = std::array<CountType, SYMBOLS>;
+
+    enum class Kernel {
+        SIMPLE,       // one table, one byte at a time
+        INTERLEAVED,  // TABLES tables, one byte at a time, unrolled
+        WORDS,        // TABLES tables, bytes picked out of 64-bit loads
+    };
+    static constexpr Kernel DEFAULT_KERNEL = Kernel::WORDS;
+    static constexpr size_t TABLES = 8;
+
+    explicit Histogram(Kernel kernel = DEFAULT_KERNEL);
+
+    void Add(std::span<const BitStream::CharType> block);
+    // Totals over everything added so far
+    const Counts& GetCounts();
+
+    // Shannon entropy of the bytes counted, in bits per byte
+    static double Entropy(const Counts& counts);
+
+private:
+    using SmallCountType = uint32_t;
+    // bytes a table can take before its counters may overflow
+    static constexpr size_t FLUSH_PERIOD = SmallCountType(-1);
+
+    void AddSimple(std::span<const uint8_t> block);
+    void AddInterleaved(std::span<const uint8_t> block);
+    void AddWords(std::span<const uint8_t> block);
+    void Flush();
+
+    Kernel kernel_;
+    Counts counts_{};
+    std::vector<std::array<SmallCountType, SYMBOLS>> tables_;
+    size_t pending_ = 0;  // bytes in tables_, not in counts_ yet
+};
@@ -0,0 +1,133 @@
+#include "read_ahead_source.h"
+
+#include <algorithm>
+
+using Size = ReadAheadSource::Size;
+using CharType = ReadAheadSource::CharType;
+
+ReadAheadSource::ReadAheadSource(std::unique_ptr<ByteSource> source, Size buffer_size, Size depth)
+    : source_(std::move(source)), current_(std::max<Size>(depth, 1)) {
+    if (buffer_size == BitStream::ADAPTIVE_BUFFER_SIZE) {
+        buffer_size = BitStream::AdaptiveBufferSize(source_->SizeHint());
+    }
+    for (Size i = 0; i < current_; ++i) {
+        buffers_.emplace_back(buffer_size);
+    }
+    Start();
+}
+ReadAheadSource::~ReadAheadSource() {
+    Stop();
+}
+
+Size ReadAheadSource::Read(CharType* buffer, Size size) {
+    auto chunk = Borrow(size);
+    std::copy(chunk.begin(), chunk.end(), buffer);
+    return chunk.size();
+}
+std::span<const CharType> ReadAheadSource::Borrow(Size max_size) {
+    std::unique_lock lock(mutex_);
+    if (current_ != buffers_.size()) {
+        auto& current = buffers_[current_];
+        if (current.buffer_pointer < current.buffer_current_size || current.buffer_current_size == 0) {
+            // the rest of a partly lent buffer, or the end of input again
+            auto size = std::min(max_size, current.buffer_current_size - current.buffer_pointer);
+            auto chunk = std::span<const CharType>(current.buffer.get() + current.buffer_pointer, size);
+            current.buffer_pointer += size;
+            return chunk;
+        }
+        free_.push_back(current_);
+        current_ = buffers_.size();
+        changed_.notify_all();
+    }
+
+    changed_.wait(lock, [this] { return !filled_.empty() || error_ != nullptr; });
+    if (filled_.empty()) {
+        std::rethrow_exception(error_);
+    }
+    current_ = filled_.front();
+    filled_.pop_front();
+
+    auto& current = buffers_[current_];
+    auto size = std::min(max_size, current.buffer_current_size);
+    current.buffer_pointer = size;
+    return {current.buffer.get(), size};
+}
+bool ReadAheadSource::CanBorrow() const {
+    return true;
+}
+void ReadAheadSource::Rewind() {
+    Stop();
+    source_->Rewind();
+    Start();
+}
+void ReadAheadSource::Seek(Size offset) {
+    Stop();
+    source_->Seek(offset);
+    Start();
+}
+Size ReadAheadSource::SizeHint() const {
+    return source_->SizeHint();
+}
+bool ReadAheadSource::CanRewind() const {
+    return source_->CanRewind();
+}
+bool ReadAheadSource::CanSeek() const {
+    return source_->CanSeek();
+}
+
+void ReadAheadSource::Start() {
+    free_.clear();
+    filled_.clear();
+    for (Size i = 0; i < buffers_.size(); ++i) {
+        free_.push_back(i);
+    }
+    current_ = buffers_.size();
+    error_ = nullptr;
+    stop_ = false;
+    reader_ = std::thread(&ReadAheadSource::Run, this);
+}
+void ReadAheadSource::Stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    if (reader_.joinable()) {
+        reader_.join();
+    }
+}
+
+void ReadAheadSource::Run() {
+    while (true) {
+        Size index = 0;
+        {
+            std::unique_lock lock(mutex_);
+            changed_.wait(lock, [this] { return stop_ || !free_.empty(); });
+            if (stop_) {
+                return;
+            }
+            index = free_.front();
+            free_.pop_front();
+        }
+
+        auto& buffer = buffers_[index];
+        try {
+            buffer.buffer_current_size = source_->Read(buffer.buffer.get(), buffer.buffer_size);
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            error_ = std::current_exception();
+            changed_.notify_all();
+            return;
+        }
+        buffer.buffer_pointer = 0;
+
+        {
+            std::lock_guard lock(mutex_);
+            filled_.push_back(index);
+        }
+        changed_.notify_all();
+        if (buffer.buffer_current_size == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "byte_source.h"
+
+// Reads the wrapped source on a helper thread, up to `depth` buffers ahead of the consumer.
+// Filled buffers are lent out through Borrow, so BitReader consumes them without a copy
+class ReadAheadSource : public ByteSource {
+public:
+    static const Size DEFAULT_DEPTH = 2;
+
+    // With ADAPTIVE_BUFFER_SIZE buffers are sized after the source's size hint
+    explicit ReadAheadSource(std::unique_ptr<ByteSource> source, Size buffer_size = BitStream::ADAPTIVE_BUFFER_SIZE,
+                             Size depth = DEFAULT_DEPTH);
+    ReadAheadSource(const ReadAheadSource& other) = delete;
+    ReadAheadSource& operator=(const ReadAheadSource& other) = delete;
+    ~ReadAheadSource() override;
+
+    Size Read(CharType* buffer, Size size) override;
+    std::span<const CharType> Borrow(Size max_size) override;
+    bool CanBorrow() const override;
+    void Rewind() override;
+    void Seek(Size offset) override;
+    Size SizeHint() const override;
+    bool CanRewind() const override;
+    bool CanSeek() const override;
+
+private:
+    void Start();
+    void Stop();
+    void Run();
+
+    std::unique_ptr<ByteSource> source_;
+    std::vector<BitStream> buffers_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Size> free_;
+    std::deque<Size> filled_;  // an empty buffer marks the end of input
+    std::exception_ptr error_;
+    bool stop_ = false;
+
+    // Buffer the consumer reads from now, buffers_.size() if none
+    Size current_;
+    std::thread reader_;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded queue between one producer thread and one consumer thread, without locks: each side only advances its own
+// counter. Push blocks while the ring is full and Pop while it is empty, which is what bounds a pipeline's memory.
+// The producer closes the ring after its last Push, the consumer cancels it to stop the producer early. In a pipeline
+// of such rings, each stage closes its output when its input ends or it fails, and cancels its input when it stops
+// early, so every stage ends whichever one stops first
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(std::max<size_t>(capacity, 1)) {
+    }
+    SpscRing(const SpscRing& other) = delete;
+    SpscRing& operator=(const SpscRing& other) = delete;
+
+    // Producer side. Returns false, leaving `value` as it is, once the consumer cancelled
+    bool Push(T& value) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            auto head = head_.load(std::memory_order_acquire);
+            if ((head & CLOSED) != 0) {
+                return false;
+            }
+            if (tail - head < slots_.size()) {
+                break;
+            }
+            head_.wait(head, std::memory_order_acquire);
+        }
+        slots_[tail % slots_.size()] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        tail_.notify_one();
+        return true;
+    }
+    bool Push(T&& value) {
+        return Push(value);
+    }
+    // After the last Push: Pop returns false once the rest is taken
+    void Close() {
+        tail_.fetch_or(CLOSED, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    // Consumer side. Returns false if the ring is closed and empty
+    bool Pop(T& value) {
+        auto head = head_.load(std::memory_order_relaxed);
+        while (true) {
+            auto tail = tail_.load(std::memory_order_acquire);
+            if ((tail & ~CLOSED) != head) {
+                break;
+            }
+            if ((tail & CLOSED) != 0) {
+                return false;
+            }
+            tail_.wait(tail, std::memory_order_acquire);
+        }
+        value = std::move(slots_[head % slots_.size()]);
+        head_.store(head + 1, std::memory_order_release);
+        head_.notify_one();
+        return true;
+    }
+    // Instead of any further Pop: Push returns false from now on
+    void Cancel() {
+        head_.fetch_or(CLOSED, std::memory_order_release);
+        head_.notify_one();
+    }
+
+    size_t Capacity() const {
+        return slots_.size();
+    }
+
+private:
+    // Set in a counter by the side that owns it
+    static constexpr size_t CLOSED = size_t(1) << (8 * sizeof(size_t) - 1);
+
+    std::vector<T> slots_;
+    // Items taken and items added, on cache lines of their own
+    alignas(64) std::atomic<size_t> head_ = 0;
+    alignas(64) std::atomic<size_t> tail_ = 0;
+};
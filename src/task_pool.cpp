@@ -0,0 +1,147 @@
+#include "task_pool.h"
+
+#include <algorithm>
+
+namespace {
+
+// Pool and worker index of the current thread, if it is a worker
+thread_local const TaskPool* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+}  // namespace
+
+TaskPool::TaskPool(size_t workers) : start_(Clock::now()) {
+    workers = std::max<size_t>(workers, 1);
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        threads_.emplace_back(&TaskPool::Run, this, i);
+    }
+}
+TaskPool::~TaskPool() {
+    {
+        std::unique_lock lock(mutex_);
+        all_done_.wait(lock, [this] { return unfinished_ == 0; });
+        stop_ = true;
+    }
+    task_queued_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void TaskPool::Submit(Task task) {
+    size_t index = 0;
+    if (current_pool == this) {
+        index = current_worker;
+    } else {
+        std::lock_guard lock(mutex_);
+        index = next_worker_++ % workers_.size();
+    }
+    // counted first: the task may be taken and finished as soon as it is in the deque
+    {
+        std::lock_guard lock(mutex_);
+        ++queued_;
+        ++unfinished_;
+    }
+    {
+        std::lock_guard lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    task_queued_.notify_one();
+}
+
+void TaskPool::Wait() {
+    std::unique_lock lock(mutex_);
+    all_done_.wait(lock, [this] { return unfinished_ == 0; });
+    if (error_ != nullptr) {
+        auto error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t TaskPool::Workers() const {
+    return workers_.size();
+}
+std::vector<TaskPool::WorkerStatistics> TaskPool::GetStatistics() const {
+    std::vector<WorkerStatistics> statistics;
+    for (const auto& worker : workers_) {
+        std::lock_guard lock(worker->mutex);
+        statistics.push_back(worker->statistics);
+    }
+    return statistics;
+}
+TaskPool::Clock::duration TaskPool::Elapsed() const {
+    return Clock::now() - start_;
+}
+
+void TaskPool::Run(size_t index) {
+    current_pool = this;
+    current_worker = index;
+    auto& worker = *workers_[index];
+    while (true) {
+        Task task;
+        bool stolen = false;
+        if (!Take(index, task, stolen)) {
+            std::unique_lock lock(mutex_);
+            task_queued_.wait(lock, [this] { return queued_ != 0 || stop_; });
+            if (queued_ == 0 && stop_) {
+                return;
+            }
+            // another worker may take it first, then this one waits again
+            continue;
+        }
+        {
+            std::lock_guard lock(mutex_);
+            --queued_;
+        }
+
+        auto started = Clock::now();
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard lock(mutex_);
+            if (error_ == nullptr) {
+                error_ = std::current_exception();
+            }
+        }
+        auto busy = Clock::now() - started;
+        {
+            std::lock_guard lock(worker.mutex);
+            ++worker.statistics.tasks;
+            worker.statistics.stolen += stolen;
+            worker.statistics.busy += busy;
+        }
+
+        std::lock_guard lock(mutex_);
+        if (--unfinished_ == 0) {
+            all_done_.notify_all();
+        }
+    }
+}
+
+bool TaskPool::Take(size_t index, Task& task, bool& stolen) {
+    {
+        auto& own = *workers_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            stolen = false;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        auto& victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs tasks on a fixed set of workers, each with its own deque. A worker takes the task it got last first, and
+// once its deque is empty takes the oldest task of another worker (work stealing). Tasks may submit more tasks
+class TaskPool {
+public:
+    using Task = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    struct WorkerStatistics {
+        size_t tasks = 0;
+        // Of `tasks`, taken from other workers
+        size_t stolen = 0;
+        Clock::duration busy{0};
+    };
+
+    explicit TaskPool(size_t workers);
+    TaskPool(const TaskPool& other) = delete;
+    TaskPool& operator=(const TaskPool& other) = delete;
+    // Finishes the tasks submitted so far, errors are lost. Call Wait to see them
+    ~TaskPool();
+
+    // From a task: onto the deque of its worker. Otherwise onto the deques in turn
+    void Submit(Task task);
+    // Blocks until every task submitted so far has finished. Rethrows the first exception a task threw
+    void Wait();
+
+    size_t Workers() const;
+    std::vector<WorkerStatistics> GetStatistics() const;
+    // Since the pool started
+    Clock::duration Elapsed() const;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        WorkerStatistics statistics;
+    };
+
+    void Run(size_t index);
+    // The next task for worker `index`: its own latest, or the oldest one of another worker
+    bool Take(size_t index, Task& task, bool& stolen);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    Clock::time_point start_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable task_queued_;
+    std::condition_variable all_done_;
+    size_t queued_ = 0;      // in the deques
+    size_t unfinished_ = 0;  // in the deques or running
+    size_t next_worker_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+
+    std::vector<std::thread> threads_;
+};
@@ -1,8 +1,26 @@
 #include <catch.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
 #include <sstream>
+#include <thread>
+
+#include <unistd.h>
 
 #include "bit_reader.h"
 #include "bit_writer.h"
+#include "read_ahead_source.h"
+#include "write_behind_sink.h"
+
+const std::string MASTER_TEXT = "../../src/tests/data/master/master_i_margarita.txt";
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream in(path, std::ios_base::binary);
+    REQUIRE(in.is_open());
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
 
 std::string ToBin(BitReader& bit_reader, std::vector<size_t> size_order, size_t wait_correct_reads = 0) {
     std::string answer;
@@ -171,3 +189,509 @@ TEST_CASE("Bit writer") {
         REQUIRE(output.str() == text);
     }
 }
+
+TEST_CASE("Bit reader peek/consume") {
+    std::string text = "Это достаточно длинный текст, чтобы аккумулятор несколько раз подгрузил буфер. 0123456789";
+    for (size_t i = 0; i < 5; ++i) {
+        text += text;
+    }
+
+    std::istringstream expected_input(text);
+    BitReader expected(expected_input);
+    std::string right_answer = ToBin(expected, {1});
+
+    for (size_t step : {1, 3, 7, 8, 13, 32, 55, 56}) {
+        std::istringstream input(text);
+        BitReader bit_reader(input);
+        std::string answer;
+
+        while (bit_reader.Refill() != 0) {
+            auto count = std::min(step, bit_reader.Available());
+            auto value = bit_reader.Peek(count);
+            REQUIRE(value == bit_reader.Peek(count));
+            for (size_t j = 0; j < count; ++j) {
+                answer += std::to_string((value >> (count - j - 1)) & 1);
+            }
+            bit_reader.Consume(count);
+        }
+
+        REQUIRE(answer == right_answer);
+    }
+    {
+        std::istringstream input("ab");
+        BitReader bit_reader(input);
+
+        REQUIRE(bit_reader.Refill() == 16);
+        REQUIRE(bit_reader.Peek(16) == (static_cast<size_t>('a') << 8 | 'b'));
+        REQUIRE(!bit_reader.ReadSome(17).second);
+        REQUIRE(bit_reader.ReadSome(8).first == 'a');
+        REQUIRE(bit_reader.Available() == 8);
+    }
+}
+
+TEST_CASE("Bit writer append") {
+    std::string text = "Проверяем, что длинные коды пишутся в том же порядке бит, что и через WriteSome.";
+    for (size_t i = 0; i < 5; ++i) {
+        text += text;
+    }
+
+    for (size_t step : {1, 5, 8, 17, 31, 32, 47, 56}) {
+        std::istringstream input(text);
+        BitReader bit_reader(input);
+
+        std::ostringstream output;
+        BitWriter bit_writer(output);
+
+        while (bit_reader.Refill() != 0) {
+            auto count = std::min(step, bit_reader.Available());
+            bit_writer.Append(bit_reader.Peek(count), count);
+            bit_reader.Consume(count);
+        }
+        bit_writer.Flush();
+
+        REQUIRE(output.str() == text);
+    }
+    {
+        std::ostringstream output;
+        BitWriter bit_writer(output);
+
+        bit_writer.Append(0b101, 3);
+        bit_writer.WriteSome(0xFFFFFFFF, 1);
+        bit_writer.Append(0, 55);
+        bit_writer.Append(0b11, 2);
+        bit_writer.Flush();
+
+        std::string right_answer = {static_cast<char>(0b10110000), 0, 0, 0, 0, 0, 0, static_cast<char>(0b00011000)};
+        REQUIRE(output.str() == right_answer);
+    }
+}
+
+std::string ReadAll(BitReader& bit_reader) {
+    std::string answer;
+    while (true) {
+        auto [value, result] = bit_reader.ReadSome(8);
+        if (!result) {
+            break;
+        }
+        answer += static_cast<char>(value);
+    }
+    return answer;
+}
+
+TEST_CASE("Byte sources") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    {
+        BitReader bit_reader(std::make_unique<FdSource>(path));
+        REQUIRE(ReadAll(bit_reader) == text);
+        bit_reader.Restore();
+        REQUIRE(ReadAll(bit_reader) == text);
+    }
+    {
+        BitReader bit_reader(std::make_unique<MmapSource>(path));
+        REQUIRE(ReadAll(bit_reader) == text);
+        bit_reader.Restore();
+        REQUIRE(ReadAll(bit_reader) == text);
+    }
+    {
+        BitReader bit_reader(std::make_unique<MemorySource>(std::span(text.data(), text.size())));
+        REQUIRE(ReadAll(bit_reader) == text);
+        bit_reader.Restore();
+        REQUIRE(ReadAll(bit_reader) == text);
+    }
+    {
+        BitReader bit_reader(std::make_unique<MmapSource>("../../src/tests/data/empty/empty"));
+        REQUIRE(ReadAll(bit_reader).empty());
+    }
+    {
+        // a pipe has no size, so it can't be mapped, only read as it comes
+        int ends[2];
+        REQUIRE(pipe(ends) == 0);
+        std::string head = text.substr(0, 1000);
+        REQUIRE(write(ends[1], head.data(), head.size()) == static_cast<ssize_t>(head.size()));
+        close(ends[1]);
+        auto pipe_path = "/dev/fd/" + std::to_string(ends[0]);
+        REQUIRE_THROWS_AS(MmapSource(pipe_path), std::system_error);
+        BitReader bit_reader(std::make_unique<FdSource>(pipe_path));
+        REQUIRE(ReadAll(bit_reader) == head);
+        close(ends[0]);
+    }
+    REQUIRE_THROWS_AS(FdSource("../../src/tests/data/no_such_file"), std::system_error);
+}
+
+TEST_CASE("Byte sinks") {
+    std::string text = "Несколько байт, которые пройдут через BitWriter в разные приёмники.";
+
+    auto write_all = [&text](BitWriter& bit_writer) {
+        for (char ch : text) {
+            bit_writer.WriteSome(static_cast<uint8_t>(ch), 8);
+        }
+        bit_writer.Flush();
+    };
+    {
+        std::vector<char> output;
+        BitWriter bit_writer(std::make_unique<MemorySink>(output));
+        write_all(bit_writer);
+        REQUIRE(std::string(output.begin(), output.end()) == text);
+    }
+    {
+        std::FILE* file = std::tmpfile();
+        REQUIRE(file != nullptr);
+        {
+            BitWriter bit_writer(std::make_unique<FdSink>(fileno(file)));
+            write_all(bit_writer);
+        }
+        BitReader bit_reader(std::make_unique<FdSource>(fileno(file)));
+        bit_reader.Restore();
+        REQUIRE(ReadAll(bit_reader) == text);
+        std::fclose(file);
+    }
+}
+
+TEST_CASE("Buffer sizes") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    for (size_t buffer_size : {64, 100, 1024, 4096, 1 << 20}) {
+        BitReader bit_reader(std::make_unique<FdSource>(path), buffer_size);
+
+        std::vector<char> output;
+        BitWriter bit_writer(std::make_unique<MemorySink>(output), buffer_size);
+        ToText(bit_writer, bit_reader, {5, 32, 3});
+
+        REQUIRE(std::string(output.begin(), output.end()) == text);
+        REQUIRE(bit_reader.IoCalls() >= text.size() / buffer_size);
+    }
+    {
+        BitReader fixed(std::make_unique<FdSource>(path), 1024);
+        BitReader adaptive(std::make_unique<FdSource>(path));
+        REQUIRE(ReadAll(fixed) == text);
+        REQUIRE(ReadAll(adaptive) == text);
+        REQUIRE(adaptive.IoCalls() * 100 < fixed.IoCalls());
+
+        std::istringstream input(text);
+        BitReader growing(input);
+        REQUIRE(ReadAll(growing) == text);
+        REQUIRE(growing.IoCalls() * 100 < fixed.IoCalls());
+    }
+    {
+        std::vector<char> fixed_output;
+        std::vector<char> adaptive_output;
+        BitWriter fixed(std::make_unique<MemorySink>(fixed_output), 1024);
+        BitWriter adaptive(std::make_unique<MemorySink>(adaptive_output));
+        for (char ch : text) {
+            fixed.WriteSome(static_cast<uint8_t>(ch), 8);
+            adaptive.WriteSome(static_cast<uint8_t>(ch), 8);
+        }
+        fixed.Flush();
+        adaptive.Flush();
+
+        REQUIRE(fixed_output == adaptive_output);
+        REQUIRE(adaptive.IoCalls() * 100 < fixed.IoCalls());
+    }
+}
+
+class FailingSource : public ByteSource {
+public:
+    Size Read(CharType* buffer, Size size) override {
+        if (reads_++ == 3) {
+            throw std::runtime_error("device is gone");
+        }
+        std::fill(buffer, buffer + size, 'x');
+        return size;
+    }
+    void Rewind() override {
+    }
+
+private:
+    size_t reads_ = 0;
+};
+
+TEST_CASE("Read-ahead source") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    for (size_t depth : {1, 2, 5}) {
+        for (size_t buffer_size : {64, 1000, 1 << 16}) {
+            auto source = std::make_unique<ReadAheadSource>(std::make_unique<FdSource>(path), buffer_size, depth);
+            BitReader bit_reader(std::move(source));
+            REQUIRE(ReadAll(bit_reader) == text);
+            bit_reader.Restore();
+            REQUIRE(ReadAll(bit_reader) == text);
+        }
+    }
+    {
+        ReadAheadSource source(std::make_unique<MemorySource>(std::span(text.data(), text.size())), 1000);
+        std::string answer;
+        while (true) {
+            auto chunk = source.Borrow(300);
+            if (chunk.empty()) {
+                break;
+            }
+            answer.append(chunk.begin(), chunk.end());
+        }
+        REQUIRE(answer == text);
+        REQUIRE(source.Borrow(300).empty());
+    }
+    {
+        std::istringstream input("");
+        BitReader bit_reader(std::make_unique<ReadAheadSource>(std::make_unique<StreamSource>(input)));
+        REQUIRE(ReadAll(bit_reader).empty());
+    }
+    {
+        BitReader bit_reader(std::make_unique<ReadAheadSource>(std::make_unique<FailingSource>(), 64, 2));
+        REQUIRE_THROWS_AS(ReadAll(bit_reader), std::runtime_error);
+    }
+}
+
+class SlowSink : public ByteSink {
+public:
+    explicit SlowSink(std::vector<char>& output, size_t fail_after = -1) : output_(output), fail_after_(fail_after) {
+    }
+
+    void Write(const CharType* data, Size size) override {
+        if (writes_++ == fail_after_) {
+            throw std::runtime_error("volume is full");
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        output_.insert(output_.end(), data, data + size);
+    }
+
+private:
+    std::vector<char>& output_;
+    size_t writes_ = 0;
+    size_t fail_after_;
+};
+
+TEST_CASE("Write-behind sink") {
+    std::string text = "Буферы уходят на запись в отдельном потоке, а кодирование продолжается. ";
+    for (size_t i = 0; i < 8; ++i) {
+        text += text;
+    }
+
+    for (size_t depth : {1, 2, 4}) {
+        for (size_t buffer_size : {size_t(64), size_t(1000), BitStream::ADAPTIVE_BUFFER_SIZE}) {
+            std::vector<char> output;
+            BitWriter bit_writer(std::make_unique<WriteBehindSink>(std::make_unique<SlowSink>(output), depth),
+                                 buffer_size);
+            for (size_t i = 0; i < text.size(); ++i) {
+                bit_writer.WriteSome(static_cast<uint8_t>(text[i]), 8);
+                if (i == text.size() / 2) {
+                    bit_writer.Flush();
+                    REQUIRE(std::string(output.begin(), output.end()) == text.substr(0, i + 1));
+                }
+            }
+            bit_writer.Flush();
+
+            REQUIRE(std::string(output.begin(), output.end()) == text);
+        }
+    }
+    {
+        std::vector<char> output;
+        {
+            WriteBehindSink sink(std::make_unique<SlowSink>(output));
+            sink.Write(text.data(), 10);
+            sink.Write(text.data() + 10, text.size() - 10);
+        }
+        REQUIRE(std::string(output.begin(), output.end()) == text);
+    }
+    {
+        std::vector<char> output;
+        BitWriter bit_writer(std::make_unique<WriteBehindSink>(std::make_unique<SlowSink>(output, 2)), 64);
+        auto write_all = [&] {
+            for (char ch : text) {
+                bit_writer.WriteSome(static_cast<uint8_t>(ch), 8);
+            }
+            bit_writer.Flush();
+        };
+        REQUIRE_THROWS_AS(write_all(), std::runtime_error);
+    }
+}
+
+TEST_CASE("Bulk bytes") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    for (size_t offset : {0, 3, 8, 13}) {
+        for (size_t block_size : {1, 7, 100, 5000, 1 << 20}) {
+            std::istringstream input(text);
+            BitReader bit_reader(std::make_unique<StreamSource>(input), 4096);
+
+            std::vector<char> output;
+            BitWriter bit_writer(std::make_unique<MemorySink>(output), 4096);
+
+            auto [head, result] = bit_reader.ReadSome(offset);
+            REQUIRE(result);
+            bit_writer.WriteSome(head, offset);
+
+            std::vector<char> block(block_size);
+            while (auto count = bit_reader.ReadBytes(block)) {
+                bit_writer.WriteBytes(std::span(block.data(), count));
+            }
+            ToText(bit_writer, bit_reader, {1});
+
+            REQUIRE(std::string(output.begin(), output.end()) == text);
+        }
+    }
+    {
+        BitReader bit_reader(std::make_unique<MmapSource>(path));
+        std::vector<char> block(1000);
+        REQUIRE(bit_reader.ReadBytes(std::span(block.data(), 3)) == 3);
+        REQUIRE(bit_reader.ReadSome(4).second);
+        REQUIRE(bit_reader.ReadBytes(block) == block.size());
+
+        std::string rest;
+        while (auto count = bit_reader.ReadBytes(block)) {
+            rest.append(block.data(), count);
+        }
+        // the last half of a byte is left
+        std::string expected(text.size() - 1004, 0);
+        for (size_t i = 0; i < expected.size(); ++i) {
+            expected[i] = (static_cast<uint8_t>(text[1003 + i]) << 4) | (static_cast<uint8_t>(text[1004 + i]) >> 4);
+        }
+        REQUIRE(rest == expected);
+    }
+}
+
+TEST_CASE("Mark and rewind") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    std::vector<std::function<std::unique_ptr<ByteSource>()>> sources = {
+        [&path] { return std::make_unique<FdSource>(path); },
+        [&path] { return std::make_unique<MmapSource>(path); },
+        [&path] { return std::make_unique<ReadAheadSource>(std::make_unique<FdSource>(path), 100, 2); },
+    };
+    for (auto& open : sources) {
+        BitReader bit_reader(open(), 64);
+        BitReader expected(open(), 64);
+
+        // marks span several refills of the 64 byte buffer
+        size_t step = 0;
+        while (step < 3000) {
+            bit_reader.Mark();
+            std::vector<uint32_t> first;
+            for (size_t i = 0; i < step % 97; ++i) {
+                auto [value, result] = bit_reader.ReadSome(13);
+                if (!result) {
+                    break;
+                }
+                first.push_back(value);
+            }
+            bit_reader.Rewind();
+            std::vector<uint32_t> second;
+            for (size_t i = 0; i < first.size(); ++i) {
+                second.push_back(bit_reader.ReadSome(13).first);
+            }
+            REQUIRE(first == second);
+            bit_reader.ReleaseMark();
+
+            for (size_t i = 0; i < first.size(); ++i) {
+                REQUIRE(expected.ReadSome(13).first == first[i]);
+            }
+            auto [value, result] = bit_reader.ReadSome(5);
+            auto [expected_value, expected_result] = expected.ReadSome(5);
+            REQUIRE(result == expected_result);
+            if (!result) {
+                break;
+            }
+            REQUIRE(value == expected_value);
+            ++step;
+        }
+        REQUIRE(step == 3000);
+    }
+    {
+        std::istringstream input("abc");
+        BitReader bit_reader(input);
+        REQUIRE_THROWS_AS(bit_reader.Rewind(), std::logic_error);
+    }
+}
+
+TEST_CASE("Tell and seek") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    auto bit_at = [&text](size_t offset) -> BitReader::ResultType {
+        return (static_cast<uint8_t>(text[offset / 8]) >> (7 - offset % 8)) & 1;
+    };
+
+    std::istringstream input(text);
+    std::vector<std::function<std::unique_ptr<ByteSource>()>> sources = {
+        [&path] { return std::make_unique<FdSource>(path); },
+        [&path] { return std::make_unique<MmapSource>(path); },
+        [&input] { return std::make_unique<StreamSource>(input); },
+        [&path] { return std::make_unique<ReadAheadSource>(std::make_unique<FdSource>(path), 100, 2); },
+    };
+    for (auto& open : sources) {
+        BitReader bit_reader(open(), 64);
+        REQUIRE(bit_reader.Tell() == 0);
+
+        std::mt19937 generator(17);
+        std::uniform_int_distribution<size_t> offsets(0, text.size() * 8 - 32);
+        for (size_t i = 0; i < 500; ++i) {
+            auto offset = offsets(generator);
+            if (i % 3 == 0) {
+                // short jumps stay within the buffer
+                offset = std::min(bit_reader.Tell() + i % 200, text.size() * 8 - 32);
+            }
+            bit_reader.SeekBits(offset);
+            REQUIRE(bit_reader.Tell() == offset);
+
+            auto [value, result] = bit_reader.ReadSome(20);
+            REQUIRE(result);
+            BitReader::ResultType expected = 0;
+            for (size_t j = 0; j < 20; ++j) {
+                expected = (expected << 1) | bit_at(offset + j);
+            }
+            REQUIRE(value == expected);
+            REQUIRE(bit_reader.Tell() == offset + 20);
+        }
+
+        bit_reader.SeekBits(100);
+        bit_reader.Mark();
+        bit_reader.SeekBits(text.size() * 4);
+        bit_reader.ReadSome(32);
+        bit_reader.Rewind();
+        REQUIRE(bit_reader.Tell() == 100);
+        REQUIRE(bit_reader.ReadSome(1).first == bit_at(100));
+
+        bit_reader.SeekBits(text.size() * 8 + 100);
+        REQUIRE(!bit_reader.ReadSome(1).second);
+    }
+    {
+        BitReader bit_reader(std::make_unique<ReadAheadSource>(std::make_unique<FailingSource>()));
+        REQUIRE_THROWS_AS(bit_reader.SeekBits(1 << 20), std::logic_error);
+    }
+}
+
+TEST_CASE("Read at") {
+    const auto& path = MASTER_TEXT;
+    auto text = ReadFile(path);
+
+    std::vector<std::function<std::unique_ptr<ByteSource>()>> sources = {
+        [&path] { return std::make_unique<FdSource>(path); },
+        [&path] { return std::make_unique<MmapSource>(path); },
+    };
+    for (auto& open : sources) {
+        BitReader bit_reader(open(), 64);
+        REQUIRE(bit_reader.CanReadAt());
+        bit_reader.ReadSome(13);
+
+        std::mt19937 generator(43);
+        std::uniform_int_distribution<size_t> offsets(0, text.size() + 100);
+        std::string block(1000, '\0');
+        for (size_t i = 0; i < 200; ++i) {
+            auto offset = offsets(generator);
+            auto read = bit_reader.ReadAt(offset, block);
+            auto expected = offset < text.size() ? text.substr(offset, block.size()) : "";
+            REQUIRE(block.substr(0, read) == expected);
+        }
+        // the reader has not moved
+        REQUIRE(bit_reader.Tell() == 13);
+    }
+
+    std::istringstream input(text);
+    BitReader stream_reader(std::make_unique<StreamSource>(input));
+    REQUIRE_FALSE(stream_reader.CanReadAt());
+}
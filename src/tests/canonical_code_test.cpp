@@ -0,0 +1,85 @@
+#include <catch.hpp>
+#include <random>
+#include <sstream>
+
+#include "bit_writer.h"
+#include "canonical_code.h"
+
+void WriteCode(BitWriter& bit_writer, const CanonicalCode::Entry& entry) {
+    for (size_t i = entry.length; i-- > 0;) {
+        auto bit = i >= CanonicalCode::CODE_SIZE ? 1 : (entry.code >> i) & 1;
+        bit_writer.WriteSome(bit, 1);
+    }
+}
+
+void CheckRoundTrip(const CanonicalCode::Lengths& lengths, const std::vector<CanonicalCode::Symbol>& message) {
+    CanonicalCode code(lengths);
+    std::stringstream stream;
+    BitWriter bit_writer(stream);
+    for (auto symbol : message) {
+        WriteCode(bit_writer, code[symbol]);
+    }
+    bit_writer.Flush();
+
+    // the decoder only sees what the archive stores
+    CanonicalCode decoder(code.Symbols(), code.LengthCounts());
+    BitReader bit_reader(stream);
+    for (auto symbol : message) {
+        REQUIRE(decoder.Decode(bit_reader) == symbol);
+    }
+}
+
+TEST_CASE("Canonical code from lengths") {
+    CanonicalCode::Lengths lengths{};
+    lengths['d'] = 4;
+    lengths['a'] = 3;
+    lengths['c'] = 4;
+    lengths['b'] = 1;
+    lengths[256] = 2;
+    CanonicalCode code(lengths);
+
+    REQUIRE(code.Symbols() == std::vector<CanonicalCode::Symbol>{'b', 256, 'a', 'c', 'd'});
+    REQUIRE(code.LengthCounts() == std::vector<size_t>{1, 1, 1, 2});
+    REQUIRE(code['b'].code == 0b0);
+    REQUIRE(code[256].code == 0b10);
+    REQUIRE(code['a'].code == 0b110);
+    REQUIRE(code['a'].length == 3);
+    REQUIRE(code['c'].code == 0b1110);
+    REQUIRE(code['d'].code == 0b1111);
+    REQUIRE(code['e'].length == 0);
+}
+
+TEST_CASE("Canonical code round trip") {
+    std::mt19937 generator(13);
+
+    CanonicalCode::Lengths balanced{};
+    std::fill(balanced.begin(), balanced.begin() + 256, 8);
+    std::vector<CanonicalCode::Symbol> message(10000);
+    for (auto& symbol : message) {
+        symbol = generator() % 256;
+    }
+    CheckRoundTrip(balanced, message);
+
+    // 1, 2, ..., 257, 258, 258: codes much longer than CODE_SIZE
+    CanonicalCode::Lengths skewed{};
+    for (size_t i = 0; i < CanonicalCode::ALPHABET_SIZE; ++i) {
+        skewed[i] = std::min(i + 1, CanonicalCode::ALPHABET_SIZE - 1);
+    }
+    for (auto& symbol : message) {
+        symbol = generator() % CanonicalCode::ALPHABET_SIZE;
+    }
+    CheckRoundTrip(skewed, message);
+}
+
+TEST_CASE("Canonical code invalid input") {
+    CanonicalCode::Lengths lengths{};
+    lengths['a'] = 1;
+    lengths['b'] = 2;
+    CanonicalCode code(lengths);
+
+    // "11" is not a code, and an empty input has none
+    std::stringstream stream("\xff");
+    BitReader bit_reader(stream);
+    REQUIRE(code.Decode(bit_reader) == CanonicalCode::NO_SYMBOL);
+    REQUIRE(code.Decode(bit_reader) == CanonicalCode::NO_SYMBOL);
+}
@@ -0,0 +1,134 @@
+#include <catch.hpp>
+#include <random>
+
+#include "code_lengths.h"
+
+// Sum of 2^-length over the codes, times 2^max_length
+uint64_t KraftSum(const CanonicalCode::Lengths& lengths, size_t max_length) {
+    uint64_t sum = 0;
+    for (auto length : lengths) {
+        if (length != 0) {
+            sum += uint64_t(1) << (max_length - length);
+        }
+    }
+    return sum;
+}
+
+TEST_CASE("Code lengths small") {
+    CodeLengths::Frequencies frequencies{};
+    frequencies['a'] = 10;
+    frequencies['b'] = 1;
+    frequencies['c'] = 1;
+    frequencies['d'] = 2;
+
+    for (auto builder : {CodeLengths::Builder::TRIE, CodeLengths::Builder::IN_PLACE}) {
+        auto lengths = CodeLengths::Build(frequencies, builder);
+        REQUIRE(lengths['a'] == 1);
+        REQUIRE(lengths['d'] == 2);
+        REQUIRE(lengths['b'] == 3);
+        REQUIRE(lengths['c'] == 3);
+        REQUIRE(lengths['e'] == 0);
+    }
+
+    CodeLengths::Frequencies single{};
+    single[7] = 5;
+    REQUIRE(CodeLengths::InPlace(single)[7] == 1);
+    REQUIRE(CodeLengths::InPlace({}) == CanonicalCode::Lengths{});
+}
+
+TEST_CASE("Code lengths builders agree") {
+    std::mt19937_64 generator(11);
+    for (int test = 0; test < 300; ++test) {
+        CodeLengths::Frequencies frequencies{};
+        size_t symbols = 2 + generator() % (CanonicalCode::ALPHABET_SIZE - 1);
+        for (size_t i = 0; i < symbols; ++i) {
+            // from flat to very skewed
+            frequencies[generator() % CanonicalCode::ALPHABET_SIZE] = 1 + (generator() >> (generator() % 40 + 24));
+        }
+
+        auto trie = CodeLengths::FromTrie(frequencies);
+        auto in_place = CodeLengths::InPlace(frequencies);
+        // ties may give different lengths, but both are optimal and complete
+        REQUIRE(CodeLengths::CodedSize(frequencies, trie) == CodeLengths::CodedSize(frequencies, in_place));
+        auto max_length = *std::max_element(in_place.begin(), in_place.end());
+        REQUIRE(max_length < 64);
+        REQUIRE(KraftSum(in_place, max_length) == uint64_t(1) << max_length);
+        for (size_t i = 0; i < frequencies.size(); ++i) {
+            REQUIRE((frequencies[i] == 0) == (in_place[i] == 0));
+        }
+    }
+}
+
+TEST_CASE("Code lengths limited") {
+    CodeLengths::Frequencies fibonacci{};
+    fibonacci[0] = 1;
+    fibonacci[1] = 1;
+    for (size_t i = 2; i < 60; ++i) {
+        fibonacci[i] = fibonacci[i - 1] + fibonacci[i - 2];
+    }
+    auto optimal = CodeLengths::InPlace(fibonacci);
+    REQUIRE(*std::max_element(optimal.begin(), optimal.end()) == 59);
+
+    for (size_t limit : {6, 9, 12, 20, 59, 70}) {
+        CAPTURE(limit);
+        auto limited = CodeLengths::Limited(fibonacci, limit);
+        auto max_length = *std::max_element(limited.begin(), limited.end());
+        REQUIRE(max_length <= limit);
+        REQUIRE(KraftSum(limited, max_length) == uint64_t(1) << max_length);
+        REQUIRE(CodeLengths::CodedSize(fibonacci, limited) >= CodeLengths::CodedSize(fibonacci, optimal));
+        if (limit >= 59) {
+            REQUIRE(CodeLengths::CodedSize(fibonacci, limited) == CodeLengths::CodedSize(fibonacci, optimal));
+        }
+    }
+    REQUIRE_THROWS_AS(CodeLengths::Limited(fibonacci, 5), std::invalid_argument);
+
+    // with 4 symbols and 2 bits, every code has length 2
+    CodeLengths::Frequencies four{};
+    four[0] = 1000;
+    four[1] = 100;
+    four[2] = 10;
+    four[3] = 1;
+    for (size_t i = 0; i < 4; ++i) {
+        REQUIRE(CodeLengths::Limited(four, 2)[i] == 2);
+    }
+    REQUIRE(CodeLengths::Limited(four, 3)[3] == 3);
+}
+
+TEST_CASE("Code lengths limited is optimal") {
+    // against a brute force over all length vectors for a few symbols
+    std::mt19937 generator(17);
+    for (int test = 0; test < 200; ++test) {
+        CodeLengths::Frequencies frequencies{};
+        size_t n = 2 + generator() % 5;
+        for (size_t i = 0; i < n; ++i) {
+            frequencies[i] = 1 + generator() % 1000;
+        }
+        size_t limit = 3;
+        if (n > (size_t(1) << limit)) {
+            continue;
+        }
+
+        uint64_t best = -1;
+        std::vector<size_t> current(n, 1);
+        while (true) {
+            uint64_t kraft = 0;
+            uint64_t cost = 0;
+            for (size_t i = 0; i < n; ++i) {
+                kraft += uint64_t(1) << (limit - current[i]);
+                cost += frequencies[i] * current[i];
+            }
+            if (kraft <= (uint64_t(1) << limit)) {
+                best = std::min(best, cost);
+            }
+            size_t i = 0;
+            while (i < n && current[i] == limit) {
+                current[i++] = 1;
+            }
+            if (i == n) {
+                break;
+            }
+            ++current[i];
+        }
+        REQUIRE(CodeLengths::CodedSize(frequencies, CodeLengths::Limited(frequencies, limit)) == best);
+    }
+}
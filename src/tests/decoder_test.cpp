@@ -1,6 +1,8 @@
 #include <catch.hpp>
 #include <fstream>
+#include <sstream>
 
+#include "bit_writer.h"
 #include "decoder.h"
 
 #include <iostream>
@@ -121,3 +123,78 @@ TEST_CASE("new lines") {
 
     IsSame("new_lines", arc_name);
 }
+TEST_CASE("stored") {
+    // two stored entries, the second one starts in the middle of a byte
+    std::vector<std::pair<std::string, std::string>> files = {{"stored_first", "raw \x01\x02\xff bytes"},
+                                                              {"stored_second", std::string(100000, '\x80')}};
+    std::stringstream archive;
+    BitWriter writer(archive);
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& [name, data] = files[i];
+        writer.WriteSome(Decoder::STORED_ENTRY, 9);
+        writer.Align();
+        writer.WriteSome(name.size(), Decoder::STORED_NAME_SIZE_BITS);
+        writer.WriteSome(0, 32);
+        writer.WriteSome(data.size(), 32);
+        writer.WriteBytes(name);
+        writer.WriteBytes(data);
+        writer.WriteSome(i + 1 == files.size() ? 258 : 257, 9);
+    }
+    writer.Flush();
+
+    Decoder decoder(BitReader(archive), "../../src/tests/unzipped/");
+    decoder.Decode();
+
+    for (const auto& [name, data] : files) {
+        std::ifstream file("../../src/tests/unzipped/" + name, std::ios_base::binary);
+        REQUIRE(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()) == data);
+    }
+}
+
+TEST_CASE("blocked") {
+    // a stored block and a block with a single byte value, coded with one bit per byte
+    std::string stored = "raw \x01\x02\xff bytes";
+    std::string name = "blocked";
+    std::stringstream archive;
+    BitWriter writer(archive);
+    writer.WriteSome(Decoder::BLOCKED_ENTRY, 9);
+    writer.Align();
+    writer.WriteSome(name.size(), Decoder::STORED_NAME_SIZE_BITS);
+    writer.WriteBytes(name);
+
+    writer.WriteSome(stored.size(), Decoder::BLOCK_SIZE_BITS);
+    writer.WriteSome(16 + 8 * stored.size(), Decoder::BLOCK_SIZE_BITS);
+    writer.WriteSome(Decoder::STORED_ENTRY, 9);
+    writer.Align();
+    writer.WriteBytes(stored);
+
+    writer.WriteSome(20, Decoder::BLOCK_SIZE_BITS);
+    writer.WriteSome(9 * 3 + 20, Decoder::BLOCK_SIZE_BITS);
+    writer.WriteSome(1, 9);
+    writer.WriteSome('z', 9);
+    writer.WriteSome(1, 9);
+    writer.WriteSome(0, 20);
+    writer.Align();
+
+    writer.WriteSome(0, Decoder::BLOCK_SIZE_BITS);
+    writer.WriteSome(258, 9);
+    writer.Flush();
+
+    for (size_t pipeline_depth : {0, 1, 3}) {
+        CAPTURE(pipeline_depth);
+        std::stringstream input(archive.str());
+        Decoder decoder(BitReader(input), "../../src/tests/unzipped/", pipeline_depth);
+        decoder.Decode();
+
+        std::ifstream file("../../src/tests/unzipped/" + name, std::ios_base::binary);
+        REQUIRE(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()) ==
+                stored + std::string(20, 'z'));
+
+        // cut in the second block
+        auto cut = archive.str();
+        cut.resize(cut.size() - 8);
+        std::stringstream truncated(cut);
+        Decoder truncated_decoder(BitReader(truncated), "../../src/tests/unzipped/", pipeline_depth);
+        REQUIRE_THROWS_AS(truncated_decoder.Decode(), Decoder::IncorrectFile);
+    }
+}
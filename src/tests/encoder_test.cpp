@@ -1,9 +1,33 @@
 #include <catch.hpp>
+#include <atomic>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <random>
+#include <set>
 #include <sstream>
+#include <thread>
 
 #include "encoder.h"
 
+const std::string MASTER_TEXT = "../../src/tests/data/master/master_i_margarita.txt";
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream in(path, std::ios_base::binary);
+    REQUIRE(in.is_open());
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+// `size` bytes of mt19937(`seed`) output
+std::string Noise(size_t size, unsigned seed) {
+    std::mt19937 generator(seed);
+    std::string noise(size, 0);
+    for (auto& byte : noise) {
+        byte = static_cast<char>(generator());
+    }
+    return noise;
+}
+
 void IsSame(std::istream& first, std::istream& second) {
     char chl = 0;
     char chr = 0;
@@ -144,3 +168,457 @@ TEST_CASE("new_lines") {
     in.close();
     correct.close();
 }
+
+// Can be read only once, like a pipe
+class OnceSource : public MemorySource {
+public:
+    using MemorySource::MemorySource;
+
+    void Rewind() override {
+        throw std::logic_error("OnceSource::Rewind");
+    }
+    bool CanRewind() const override {
+        return false;
+    }
+    bool CanSeek() const override {
+        return false;
+    }
+    bool InMemory() const override {
+        return false;
+    }
+    bool CanReadAt() const override {
+        return false;
+    }
+};
+
+// Can start over, but not seek anywhere else, like a stream that reopens its input
+class RewindSource : public MemorySource {
+public:
+    using MemorySource::MemorySource;
+
+    void Seek(Size offset) override {
+        if (offset != 0) {
+            throw std::logic_error("RewindSource::Seek");
+        }
+        Rewind();
+    }
+    bool CanSeek() const override {
+        return false;
+    }
+    bool CanBorrow() const override {
+        return false;
+    }
+    bool InMemory() const override {
+        return false;
+    }
+    bool CanReadAt() const override {
+        return false;
+    }
+};
+
+TEST_CASE("single read") {
+    auto data = ReadFile(MASTER_TEXT);
+    auto expected = ReadFile("../../src/tests/data/master.arc");
+    std::ifstream in(MASTER_TEXT, std::ios_base::binary);
+
+    auto open = [&](bool can_seek) -> std::unique_ptr<ByteSource> {
+        if (!can_seek) {
+            return std::make_unique<OnceSource>(data);
+        }
+        in.clear();
+        in.seekg(0);
+        return std::make_unique<StreamSource>(in);
+    };
+
+    for (size_t limit : {size_t(0), size_t(1000), size_t(1) << 30}) {
+        for (bool can_seek : {true, false}) {
+            CAPTURE(limit, can_seek);
+            BitReader one_pass(open(can_seek), BitStream::DEFAULT_BUFFER_SIZE);
+            std::string block(Encoder::READ_BLOCK_SIZE, 0);
+            while (one_pass.ReadBytes(block) != 0) {
+            }
+
+            std::stringstream output;
+            Encoder encoder({.output = BitWriter(output)}, {.single_read_limit = limit});
+            encoder.EncodeFile(
+                {.name = "master_i_margarita.txt", .input = BitReader(open(can_seek), BitStream::DEFAULT_BUFFER_SIZE)},
+                true);
+
+            REQUIRE(output.str() == expected);
+            auto statistics = encoder.GetStatistics();
+            bool read_twice = can_seek && limit < data.size();
+            REQUIRE(statistics.input_reads == (read_twice ? 2 : 1) * one_pass.IoCalls());
+            REQUIRE((statistics.spilled_bytes == data.size()) == (!can_seek && limit < data.size()));
+        }
+    }
+}
+
+TEST_CASE("stored") {
+    auto noise = Noise(100000, 19);
+
+    std::stringstream output;
+    Encoder encoder({.output = BitWriter(output)});
+    encoder.EncodeFile({.name = "noise", .input = BitReader(std::make_unique<MemorySource>(noise))}, true);
+
+    REQUIRE(encoder.GetStatistics().stored_files == 1);
+    auto expected_bits = Encoder::StoredEntrySize(0, 5, noise.size());
+    REQUIRE(output.str().size() == (expected_bits + 7) / 8);
+    // 9 bits of STORED_ENTRY, padding, sizes, then the name and the data as they are
+    REQUIRE(output.str().substr(0, 2) == "\xff\x80");
+    REQUIRE(output.str().substr(2 + 2 + 8, 5) == "noise");
+    REQUIRE(output.str().substr(2 + 2 + 8 + 5, noise.size()) == noise);
+}
+
+TEST_CASE("sampling") {
+    auto noise = Noise(1 << 20, 23);
+    auto text = ReadFile(MASTER_TEXT);
+
+    std::stringstream output;
+    Encoder encoder({.output = BitWriter(output)}, {.sample_size = 1 << 16});
+    encoder.EncodeFile({.name = "noise", .input = BitReader(std::make_unique<MemorySource>(noise))}, false);
+    encoder.EncodeFile({.name = "text", .input = BitReader(std::make_unique<MemorySource>(text))}, false);
+    // too small to be sampled
+    encoder.EncodeFile({.name = "small", .input = BitReader(std::make_unique<MemorySource>(noise.substr(0, 1000)))},
+                       true);
+
+    auto statistics = encoder.GetStatistics();
+    REQUIRE(statistics.sampled_stored_files == 1);
+    REQUIRE(statistics.sampled_scanned_files == 1);
+    REQUIRE(statistics.sample_misses == 0);
+    REQUIRE(statistics.stored_files == 2);
+    REQUIRE(statistics.sample_entropy_error < 0.1);
+    REQUIRE(output.str().find(noise) != std::string::npos);
+
+    // sampling would seek all over the file, so a source that can only rewind is scanned in full
+    std::stringstream rewound;
+    Encoder rewinding({.output = BitWriter(rewound)}, {.sample_size = 1 << 16});
+    rewinding.EncodeFile({.name = "noise", .input = BitReader(std::make_unique<RewindSource>(noise))}, true);
+    statistics = rewinding.GetStatistics();
+    REQUIRE(statistics.sampled_stored_files == 0);
+    REQUIRE(statistics.sampled_scanned_files == 0);
+    REQUIRE(statistics.stored_files == 1);
+    REQUIRE(rewound.str().find(noise) != std::string::npos);
+}
+
+TEST_CASE("size prediction") {
+    auto noise = Noise(1 << 18, 29);
+    auto text = ReadFile(MASTER_TEXT);
+    // stored entries land at different bit offsets depending on what precedes them
+    std::vector<std::pair<std::string, std::string>> files = {
+        {"noise", noise}, {"text", text}, {"a", "a"}, {"small noise", noise.substr(0, 3000)}, {"empty", ""}};
+
+    for (auto options : {Encoder::Options{}, Encoder::Options{.max_code_length = 9, .sample_size = 1 << 14},
+                         Encoder::Options{.block_size = 1000}}) {
+        for (size_t threads : {1, 3}) {
+            CAPTURE(options.sample_size, options.block_size, threads);
+            auto open = [&](size_t index) -> Encoder::InputStream {
+                return {.name = files[index].first,
+                        .input = BitReader(std::make_unique<MemorySource>(files[index].second))};
+            };
+            auto prediction = Encoder::PredictSize(files.size(), open, options, threads);
+
+            std::stringstream output;
+            Encoder encoder({.output = BitWriter(output)}, options);
+            size_t stored = 0;
+            for (size_t i = 0; i < files.size(); ++i) {
+                encoder.EncodeFile(open(i), i + 1 == files.size());
+                stored += prediction.entries[i].stored;
+            }
+            REQUIRE(prediction.entries.size() == files.size());
+            REQUIRE(prediction.archive_bytes == output.str().size());
+            REQUIRE(stored == encoder.GetStatistics().stored_files);
+            // blocks of noise are stored, the entry is not
+            REQUIRE(prediction.entries[0].stored == (options.block_size == 0));
+            REQUIRE_FALSE(prediction.entries[1].stored);
+        }
+    }
+}
+
+TEST_CASE("blocks") {
+    auto noise = Noise(10000, 31);
+    auto text = ReadFile(MASTER_TEXT);
+    // text, a run of a single byte and noise: blocks get their own tables, or are stored
+    auto data = text.substr(0, 20000) + std::string(5000, 'z') + noise;
+    size_t block_size = 4096;
+
+    std::stringstream output;
+    Encoder encoder({.output = BitWriter(output)}, {.block_size = block_size});
+    encoder.EncodeFile({.name = "small", .input = BitReader(std::make_unique<MemorySource>(text.substr(0, 1000)))},
+                       false);
+    auto small_size = output.str().size();
+    encoder.EncodeFile({.name = "mixed", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+
+    auto statistics = encoder.GetStatistics();
+    REQUIRE(statistics.coded_blocks + statistics.stored_blocks == (data.size() + block_size - 1) / block_size);
+    REQUIRE(statistics.coded_blocks >= (data.size() - noise.size()) / block_size);
+    REQUIRE(statistics.stored_blocks >= noise.size() / block_size);
+    REQUIRE(statistics.stored_files == 0);
+    // a file that fits into a block keeps the usual entry
+    REQUIRE(output.str().size() > small_size);
+    REQUIRE(output.str().substr(0, small_size).find("small") == std::string::npos);
+    REQUIRE(output.str().find("mixed") != std::string::npos);
+    auto noise_block = ((data.size() - noise.size()) / block_size + 1) * block_size;
+    REQUIRE(output.str().find(data.substr(noise_block, block_size)) != std::string::npos);
+}
+
+TEST_CASE("parallel") {
+    auto noise = Noise(50000, 37);
+    auto text = ReadFile(MASTER_TEXT);
+    // coded, stored and blocked entries starting at every bit offset
+    std::vector<std::pair<std::string, std::string>> files;
+    for (size_t i = 0; i < 24; ++i) {
+        files.emplace_back("file" + std::to_string(i), i % 3 == 0   ? noise.substr(0, 1000 + i)
+                                                      : i % 3 == 1 ? text.substr(i * 1000, 30000 + 7 * i)
+                                                                   : std::string(i, 'a'));
+    }
+    auto open = [&](size_t index) -> Encoder::InputStream {
+        return {.name = files[index].first, .input = BitReader(std::make_unique<MemorySource>(files[index].second))};
+    };
+
+    for (auto options : {Encoder::Options{}, Encoder::Options{.block_size = 8192}}) {
+        std::stringstream expected;
+        Encoder serial({.output = BitWriter(expected)}, options);
+        serial.EncodeFiles(files.size(), open, 1);
+
+        for (size_t threads : {2, 5}) {
+            CAPTURE(options.block_size, threads);
+            std::stringstream output;
+            Encoder encoder({.output = BitWriter(output)}, options);
+            encoder.EncodeFiles(files.size(), open, threads);
+
+            REQUIRE(output.str() == expected.str());
+            auto statistics = encoder.GetStatistics();
+            REQUIRE(statistics.stored_files == serial.GetStatistics().stored_files);
+            REQUIRE(statistics.coded_bits == serial.GetStatistics().coded_bits);
+            REQUIRE(statistics.coded_blocks == serial.GetStatistics().coded_blocks);
+        }
+    }
+
+    // The second entry is stored or coded depending on where it starts, after first entries of different sizes. It is
+    // encoded ahead of its turn: the first file opens once the second one has. It is read once, like a pipe
+    std::mt19937 biased_generator(5);
+    std::string biased(4533, 0);
+    for (auto& byte : biased) {
+        byte = (biased_generator() % 8 == 0) ? 'a' : static_cast<char>(biased_generator());
+    }
+    std::set<size_t> stored_files;
+    for (size_t first_size = 1; first_size <= 8; ++first_size) {
+        CAPTURE(first_size);
+        std::vector<std::pair<std::string, std::string>> shifted = {{"p", std::string(first_size, 'q')}, {"d", biased}};
+        std::atomic<size_t> opened = 0;
+        std::atomic<bool> second_opened = false;
+        bool in_order = false;
+        auto open_shifted = [&](size_t index) -> Encoder::InputStream {
+            ++opened;
+            second_opened = second_opened || index == 1;
+            while (in_order && !second_opened) {
+                std::this_thread::yield();
+            }
+            return {.name = shifted[index].first,
+                    .input = BitReader(std::make_unique<OnceSource>(shifted[index].second))};
+        };
+        std::stringstream expected;
+        Encoder serial({.output = BitWriter(expected)});
+        serial.EncodeFiles(shifted.size(), open_shifted, 1);
+        opened = 0;
+        in_order = true;
+        std::stringstream output;
+        Encoder encoder({.output = BitWriter(output)});
+        encoder.EncodeFiles(shifted.size(), open_shifted, 2);
+        REQUIRE(output.str() == expected.str());
+        REQUIRE(opened == 2);
+        auto statistics = encoder.GetStatistics();
+        REQUIRE(statistics.stored_files == serial.GetStatistics().stored_files);
+        REQUIRE(statistics.coded_bits == serial.GetStatistics().coded_bits);
+        stored_files.insert(statistics.stored_files);
+    }
+    // stitched stored, and coded from the stored part
+    REQUIRE(stored_files == std::set<size_t>{0, 1});
+
+    // and one larger than Encoder::PART_MEMORY_SIZE goes through a temporary file
+    auto large = Noise(Encoder::PART_MEMORY_SIZE + 1000, 43);
+    std::atomic<bool> large_opened = false;
+    bool in_order = false;
+    auto open_large = [&](size_t index) -> Encoder::InputStream {
+        large_opened = large_opened || index == 1;
+        while (in_order && !large_opened) {
+            std::this_thread::yield();
+        }
+        return {.name = "file" + std::to_string(index),
+                .input = BitReader(std::make_unique<MemorySource>(index == 1 ? large : files[index].second))};
+    };
+    std::stringstream expected;
+    Encoder serial({.output = BitWriter(expected)});
+    serial.EncodeFiles(3, open_large, 1);
+    REQUIRE(serial.GetStatistics().spilled_bytes == 0);
+    in_order = true;
+    std::stringstream output;
+    Encoder encoder({.output = BitWriter(output)});
+    encoder.EncodeFiles(3, open_large, 2);
+    REQUIRE(output.str() == expected.str());
+    REQUIRE(encoder.GetStatistics().spilled_bytes > Encoder::PART_MEMORY_SIZE);
+
+    auto failing_open = [&](size_t index) -> Encoder::InputStream {
+        if (index == 7) {
+            throw std::runtime_error("can't open");
+        }
+        return open(index);
+    };
+    Encoder failing({.output = BitWriter(output)});
+    REQUIRE_THROWS_AS(failing.EncodeFiles(files.size(), failing_open, 3), std::runtime_error);
+}
+
+TEST_CASE("parallel blocks") {
+    auto data = ReadFile(MASTER_TEXT) + Noise(20000, 41);
+
+    Encoder::Options options{.block_size = 3000};
+    std::stringstream expected;
+    Encoder serial({.output = BitWriter(expected)}, options);
+    serial.EncodeFile({.name = "data", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+
+    for (size_t threads : {2, 4}) {
+        CAPTURE(threads);
+        options.block_threads = threads;
+        std::stringstream output;
+        Encoder encoder({.output = BitWriter(output)}, options);
+        encoder.EncodeFile({.name = "data", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+
+        REQUIRE(output.str() == expected.str());
+        auto statistics = encoder.GetStatistics();
+        REQUIRE(statistics.coded_blocks == serial.GetStatistics().coded_blocks);
+        REQUIRE(statistics.stored_blocks == serial.GetStatistics().stored_blocks);
+        REQUIRE(statistics.coded_bits == serial.GetStatistics().coded_bits);
+    }
+
+    for (size_t depth : {1, 2, 5}) {
+        CAPTURE(depth);
+        options.block_threads = 1;
+        options.pipeline_depth = depth;
+        std::stringstream output;
+        Encoder encoder({.output = BitWriter(output)}, options);
+        encoder.EncodeFile({.name = "data", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+
+        REQUIRE(output.str() == expected.str());
+        auto statistics = encoder.GetStatistics();
+        REQUIRE(statistics.coded_blocks == serial.GetStatistics().coded_blocks);
+        REQUIRE(statistics.stored_blocks == serial.GetStatistics().stored_blocks);
+        REQUIRE(statistics.input_reads == serial.GetStatistics().input_reads);
+    }
+}
+
+TEST_CASE("parallel histogram") {
+    auto text = ReadFile(MASTER_TEXT);
+    std::string data;
+    std::mt19937 generator(47);
+    while (data.size() < 3 * Encoder::PARALLEL_HISTOGRAM_MIN_SIZE) {
+        data += text.substr(generator() % text.size());
+    }
+
+    std::stringstream expected;
+    Encoder serial({.output = BitWriter(expected)});
+    serial.EncodeFile({.name = "data", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+
+    for (size_t threads : {2, 3, 7, 64}) {
+        CAPTURE(threads);
+        std::stringstream output;
+        Encoder encoder({.output = BitWriter(output)}, {.histogram_threads = threads});
+        encoder.EncodeFile({.name = "data", .input = BitReader(std::make_unique<MemorySource>(data))}, true);
+        REQUIRE(output.str() == expected.str());
+        REQUIRE(encoder.GetStatistics().input_reads > serial.GetStatistics().input_reads);
+    }
+
+    // kept in memory for the encoding pass: counted in order
+    std::stringstream output;
+    std::istringstream stream(data);
+    Encoder encoder({.output = BitWriter(output)}, {.single_read_limit = data.size(), .histogram_threads = 3});
+    encoder.EncodeFile({.name = "data", .input = BitReader(std::make_unique<StreamSource>(stream))}, true);
+    REQUIRE(output.str() == expected.str());
+}
+
+TEST_CASE("work stealing") {
+    auto text = ReadFile(MASTER_TEXT);
+    auto noisy = text + Noise(20000, 53);
+    // split into blocks: 1 and 4 only, 2 cannot be read at any offset
+    const std::vector<std::string> files = {"abc", noisy, noisy, "", text.substr(0, 5000)};
+    std::deque<std::istringstream> streams;
+    std::mutex mutex;
+    auto open = [&](size_t index) -> Encoder::InputStream {
+        auto name = "file" + std::to_string(index);
+        if (index == 2) {
+            std::lock_guard lock(mutex);
+            streams.emplace_back(files[index]);
+            return {.name = name, .input = BitReader(std::make_unique<StreamSource>(streams.back()))};
+        }
+        return {.name = name, .input = BitReader(std::make_unique<MemorySource>(files[index]))};
+    };
+    auto size_of = [&](size_t index) { return files[index].size(); };
+
+    Encoder::Options options{.block_size = 3000};
+    std::stringstream expected;
+    Encoder serial({.output = BitWriter(expected)}, options);
+    serial.EncodeFiles(files.size(), open, 1);
+    REQUIRE(serial.GetStatistics().workers.empty());
+
+    for (size_t threads : {2, 3}) {
+        CAPTURE(threads);
+        std::stringstream output;
+        Encoder encoder({.output = BitWriter(output)}, options);
+        encoder.EncodeFiles(files.size(), open, threads, size_of);
+        REQUIRE(output.str() == expected.str());
+
+        auto statistics = encoder.GetStatistics();
+        REQUIRE(statistics.coded_blocks == serial.GetStatistics().coded_blocks);
+        REQUIRE(statistics.stored_blocks == serial.GetStatistics().stored_blocks);
+        REQUIRE(statistics.workers.size() == threads);
+        size_t tasks = 0;
+        for (const auto& worker : statistics.workers) {
+            tasks += worker.tasks;
+            REQUIRE(worker.stolen <= worker.tasks);
+            REQUIRE(worker.utilization >= 0);
+            REQUIRE(worker.utilization <= 1);
+        }
+        REQUIRE(tasks == files.size() + (noisy.size() + 2999) / 3000 + 2);
+    }
+
+    // stored on the estimate that told whether to split it: sampled once
+    const std::vector<std::string> noise_files = {"abc", Noise(100000, 59)};
+    auto open_noise = [&](size_t index) -> Encoder::InputStream {
+        return {.name = "noise" + std::to_string(index),
+                .input = BitReader(std::make_unique<MemorySource>(noise_files[index]))};
+    };
+    options.sample_size = 4096;
+    std::stringstream sampled_expected;
+    Encoder sampled_serial({.output = BitWriter(sampled_expected)}, options);
+    sampled_serial.EncodeFiles(2, open_noise, 1);
+    std::stringstream sampled_output;
+    Encoder sampled({.output = BitWriter(sampled_output)}, options);
+    sampled.EncodeFiles(2, open_noise, 2);
+    REQUIRE(sampled_output.str() == sampled_expected.str());
+    REQUIRE(sampled.GetStatistics().sampled_stored_files == 1);
+    REQUIRE(sampled.GetStatistics().input_reads == sampled_serial.GetStatistics().input_reads);
+}
+
+TEST_CASE("long codes") {
+    // 1, 2, ..., 257, 258, 258: no file this side of a terabyte gets codes that long, so they are set up by hand.
+    // Codes longer than BitWriter::MAX_APPEND_REQUEST are split over several appends
+    CanonicalCode::Lengths lengths{};
+    for (size_t i = 0; i < CanonicalCode::ALPHABET_SIZE; ++i) {
+        lengths[i] = std::min(i + 1, CanonicalCode::ALPHABET_SIZE - 1);
+    }
+    CanonicalCode code_table(lengths);
+    REQUIRE(code_table.LengthCounts().size() > BitWriter::MAX_APPEND_REQUEST);
+
+    auto block = Noise(3000, 61);
+    std::stringstream output;
+    Encoder::OutputStream target{.output = BitWriter(output)};
+    Encoder::Output(target, code_table, block);
+    Encoder::Output(target, code_table[Encoder::ARCHIVE_END]);
+    target.output.Flush();
+
+    CanonicalCode decoder(code_table.Symbols(), code_table.LengthCounts());
+    BitReader input(output);
+    for (auto byte : block) {
+        REQUIRE(decoder.Decode(input) == static_cast<uint8_t>(byte));
+    }
+    REQUIRE(decoder.Decode(input) == Encoder::ARCHIVE_END);
+}
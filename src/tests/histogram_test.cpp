@@ -0,0 +1,56 @@
+#include <catch.hpp>
+#include <random>
+
+#include "histogram.h"
+
+Histogram::Counts Reference(const std::vector<BitStream::CharType>& data) {
+    Histogram::Counts counts{};
+    for (auto byte : data) {
+        ++counts[static_cast<uint8_t>(byte)];
+    }
+    return counts;
+}
+
+TEST_CASE("Histogram kernels") {
+    std::mt19937 generator(3);
+    std::vector<BitStream::CharType> data(100003);
+    for (auto& byte : data) {
+        // skewed, with runs
+        byte = static_cast<BitStream::CharType>(generator() % 7 == 0 ? generator() : 'e');
+    }
+    auto expected = Reference(data);
+
+    for (auto kernel : {Histogram::Kernel::SIMPLE, Histogram::Kernel::INTERLEAVED, Histogram::Kernel::WORDS}) {
+        CAPTURE(static_cast<int>(kernel));
+        Histogram histogram(kernel);
+        // blocks of odd sizes leave tails of every length
+        for (size_t i = 0, size = 1; i < data.size(); i += size, size = size * 3 % 1001) {
+            histogram.Add(std::span(data).subspan(i, std::min(size, data.size() - i)));
+        }
+        REQUIRE(histogram.GetCounts() == expected);
+
+        // counts keep adding up after GetCounts
+        histogram.Add(data);
+        auto twice = expected;
+        for (auto& count : twice) {
+            count *= 2;
+        }
+        REQUIRE(histogram.GetCounts() == twice);
+    }
+}
+
+TEST_CASE("Histogram empty") {
+    Histogram histogram;
+    histogram.Add({});
+    REQUIRE(histogram.GetCounts() == Histogram::Counts{});
+}
+
+TEST_CASE("Histogram entropy") {
+    Histogram::Counts counts{};
+    counts['a'] = 10;
+    REQUIRE(Histogram::Entropy(counts) == 0);
+    counts['b'] = 10;
+    REQUIRE(Histogram::Entropy(counts) == Approx(1));
+    counts.fill(3);
+    REQUIRE(Histogram::Entropy(counts) == Approx(8));
+}
@@ -0,0 +1,73 @@
+#include <catch.hpp>
+
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.h"
+
+TEST_CASE("ring in order") {
+    SpscRing<int> ring(3);
+    REQUIRE(ring.Capacity() == 3);
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(ring.Push(i));
+    }
+    int value = -1;
+    REQUIRE(ring.Pop(value));
+    REQUIRE(value == 0);
+    REQUIRE(ring.Push(3));
+    ring.Close();
+    for (int i = 1; i <= 3; ++i) {
+        REQUIRE(ring.Pop(value));
+        REQUIRE(value == i);
+    }
+    REQUIRE_FALSE(ring.Pop(value));
+    REQUIRE(value == 3);
+}
+
+TEST_CASE("ring between threads") {
+    for (size_t capacity : {1, 2, 7}) {
+        SpscRing<std::vector<size_t>> ring(capacity);
+        const size_t count = 20000;
+        bool pushed = true;
+        std::thread producer([&] {
+            for (size_t i = 0; i < count; ++i) {
+                pushed = ring.Push(std::vector<size_t>(i % 5, i)) && pushed;
+            }
+            ring.Close();
+        });
+
+        std::vector<size_t> item;
+        size_t received = 0;
+        bool in_order = true;
+        while (ring.Pop(item)) {
+            in_order = in_order && item == std::vector<size_t>(received % 5, received);
+            ++received;
+        }
+        producer.join();
+        REQUIRE(pushed);
+        REQUIRE(received == count);
+        REQUIRE(in_order);
+    }
+}
+
+TEST_CASE("ring cancel") {
+    SpscRing<int> ring(2);
+    int pushed = 0;
+    std::thread producer([&] {
+        while (ring.Push(pushed)) {
+            ++pushed;
+        }
+        ring.Close();
+    });
+
+    int value = 0;
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(ring.Pop(value));
+        REQUIRE(value == i);
+    }
+    ring.Cancel();
+    producer.join();
+    // blocked on a full ring until the consumer cancelled
+    REQUIRE(pushed >= 3);
+    REQUIRE(pushed <= 5);
+}
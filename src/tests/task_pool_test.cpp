@@ -0,0 +1,88 @@
+#include <catch.hpp>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#include "task_pool.h"
+
+TEST_CASE("task pool runs every task") {
+    for (size_t workers : {1, 2, 4}) {
+        TaskPool pool(workers);
+        REQUIRE(pool.Workers() == workers);
+
+        std::atomic<size_t> sum = 0;
+        for (size_t i = 1; i <= 100; ++i) {
+            pool.Submit([&sum, i] { sum += i; });
+        }
+        pool.Wait();
+        REQUIRE(sum == 5050);
+
+        // and the tasks those submit
+        for (size_t i = 0; i < 10; ++i) {
+            pool.Submit([&pool, &sum] {
+                for (size_t j = 0; j < 10; ++j) {
+                    pool.Submit([&sum] { ++sum; });
+                }
+            });
+        }
+        pool.Wait();
+        REQUIRE(sum == 5150);
+
+        size_t tasks = 0;
+        size_t stolen = 0;
+        for (const auto& worker : pool.GetStatistics()) {
+            tasks += worker.tasks;
+            stolen += worker.stolen;
+            REQUIRE(worker.busy <= pool.Elapsed());
+        }
+        REQUIRE(tasks == 210);
+        REQUIRE(stolen <= tasks);
+        if (workers == 1) {
+            REQUIRE(stolen == 0);
+        }
+    }
+}
+
+TEST_CASE("task pool steals") {
+    TaskPool pool(2);
+    std::atomic<size_t> done = 0;
+    // the first worker holds on to one of its tasks, so the other one has to take the rest
+    pool.Submit([&pool, &done] {
+        for (size_t i = 0; i < 8; ++i) {
+            pool.Submit([&done] { ++done; });
+        }
+        while (done < 8) {
+            std::this_thread::yield();
+        }
+        ++done;
+    });
+    pool.Wait();
+    REQUIRE(done == 9);
+
+    size_t stolen = 0;
+    for (const auto& worker : pool.GetStatistics()) {
+        stolen += worker.stolen;
+    }
+    REQUIRE(stolen == 8);
+}
+
+TEST_CASE("task pool errors") {
+    TaskPool pool(3);
+    std::atomic<size_t> done = 0;
+    for (size_t i = 0; i < 20; ++i) {
+        pool.Submit([&done, i] {
+            ++done;
+            if (i % 7 == 3) {
+                throw std::runtime_error("task failed");
+            }
+        });
+    }
+    REQUIRE_THROWS_AS(pool.Wait(), std::runtime_error);
+    REQUIRE(done == 20);
+
+    // reported once
+    pool.Submit([&done] { ++done; });
+    pool.Wait();
+    REQUIRE(done == 21);
+}
@@ -0,0 +1,88 @@
+#include "write_behind_sink.h"
+
+#include <algorithm>
+
+using Size = WriteBehindSink::Size;
+using CharType = WriteBehindSink::CharType;
+
+WriteBehindSink::WriteBehindSink(std::unique_ptr<ByteSink> sink, Size depth)
+    : sink_(std::move(sink)), depth_(std::max<Size>(depth, 1)), flusher_(&WriteBehindSink::Run, this) {
+}
+WriteBehindSink::~WriteBehindSink() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    flusher_.join();
+}
+
+void WriteBehindSink::Write(const CharType* data, Size size) {
+    BitStream stream(size);
+    std::copy(data, data + size, stream.buffer.get());
+    stream.buffer_pointer = size;
+    Enqueue(std::move(stream));
+}
+void WriteBehindSink::Submit(BitStream& stream) {
+    auto size = stream.buffer_size;
+    Enqueue(std::move(stream));
+
+    std::lock_guard lock(mutex_);
+    auto recycled = std::find_if(free_.begin(), free_.end(), [size](const BitStream& e) {
+        return e.buffer_size == size;
+    });
+    if (recycled == free_.end()) {
+        stream = BitStream(size);
+    } else {
+        stream = std::move(*recycled);
+        free_.erase(recycled);
+    }
+    stream.buffer_pointer = 0;
+}
+void WriteBehindSink::Flush() {
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this] { return (queue_.empty() && !writing_) || error_ != nullptr; });
+    if (error_ != nullptr) {
+        std::rethrow_exception(error_);
+    }
+    sink_->Flush();
+}
+
+void WriteBehindSink::Enqueue(BitStream&& stream) {
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this] { return queue_.size() < depth_ || error_ != nullptr; });
+    if (error_ != nullptr) {
+        std::rethrow_exception(error_);
+    }
+    queue_.push_back(std::move(stream));
+    changed_.notify_all();
+}
+
+void WriteBehindSink::Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        changed_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty() || error_ != nullptr) {
+            return;
+        }
+        auto stream = std::move(queue_.front());
+        queue_.pop_front();
+        writing_ = true;
+
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            sink_->Write(stream.buffer.get(), stream.buffer_pointer);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        writing_ = false;
+        error_ = error;
+        if (free_.size() < depth_) {
+            free_.push_back(std::move(stream));
+        }
+        changed_.notify_all();
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "byte_sink.h"
+
+// Writes to the wrapped sink on a flusher thread. Submitted buffers are queued, at most `depth` of them,
+// and the writer goes on with a recycled one. Flush waits until everything queued is written
+class WriteBehindSink : public ByteSink {
+public:
+    static const Size DEFAULT_DEPTH = 2;
+
+    explicit WriteBehindSink(std::unique_ptr<ByteSink> sink, Size depth = DEFAULT_DEPTH);
+    WriteBehindSink(const WriteBehindSink& other) = delete;
+    WriteBehindSink& operator=(const WriteBehindSink& other) = delete;
+    // Writes what is still queued, errors are lost. Call Flush to see them
+    ~WriteBehindSink() override;
+
+    void Write(const CharType* data, Size size) override;
+    void Submit(BitStream& stream) override;
+    void Flush() override;
+
+private:
+    void Enqueue(BitStream&& stream);
+    void Run();
+
+    std::unique_ptr<ByteSink> sink_;
+    Size depth_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<BitStream> queue_;
+    std::vector<BitStream> free_;
+    bool writing_ = false;
+    std::exception_ptr error_;
+    bool stop_ = false;
+
+    std::thread flusher_;
+};